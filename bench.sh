@@ -0,0 +1,68 @@
+#!/bin/sh
+# Sweep the pipeline without hardware: for every block size build the
+# kernel benchmark and bladeout against the fake device, time the
+# kernels, then stream /dev/zero through every combination of buffer
+# size, circular buffer size and read size. Each combination runs
+# unpaced for its top speed, then paced at the samplerate for
+# underruns and how often the device would have run dry.
+#
+# Everything can be set from the environment, for example
+#   BENCH_ARGS="-F cf32 -w 2" BENCH_SAMPLES="4096 16384" make bench
+
+UNROLLS=${BENCH_UNROLL:-"4096 8192 16384"}
+SAMPLES=${BENCH_SAMPLES:-"4096 16384 65536"}
+PREBUFS=${BENCH_PREBUF:-"16 64"}
+BLOCKS=${BENCH_BLOCKS:-"16384 262144"}
+RATE=${BENCH_RATE:-20000000}
+SECONDS_PER_RUN=${BENCH_SECONDS:-2}
+ARGS=${BENCH_ARGS:-"-F cs16"}
+MAKE=${MAKE:-make}
+
+# The value of key= in the last line that has it
+value() {
+	sed -n "s/.*[ :]$1=\([^ ]*\).*/\1/p" "$2" | tail -n 1
+}
+
+run() {
+	timeout -k 5 -s INT "$SECONDS_PER_RUN" ./bladeout-bench -i /dev/zero \
+		-r "$RATE" -s "$1" -p "$2" -R "$3" -S 3600 $ARGS > "$log" 2>&1
+
+	if ! grep -q "^bench:" "$log"; then
+		echo "run failed: -s $1 -p $2 -R $3 $ARGS" >&2
+		tail -n 5 "$log" >&2
+		return 1
+	fi
+}
+
+log=$(mktemp) || exit 1
+trap 'rm -f "$log"' EXIT
+
+for unroll in $UNROLLS; do
+	$MAKE -s clean-bench
+	$MAKE -s UNROLL="$unroll" bladeout-bench bench-kernels || exit 1
+
+	./bench-kernels || exit 1
+
+	for s in $SAMPLES; do
+		for p in $PREBUFS; do
+			for r in $BLOCKS; do
+				BENCH_UNPACED=1 run "$s" "$p" "$r" || continue
+				msps=$(value msps "$log")
+				full=$(value full_waits "$log")
+
+				run "$s" "$p" "$r" || continue
+
+				echo "pipeline: unroll=$unroll samples=$s prebuffer=$p" \
+					"blocksize=$r max_msps=$msps max_full_waits=$full" \
+					"rate_msps=$(value msps "$log")" \
+					"underruns=$(value underruns "$log")" \
+					"late=$(value late "$log")" \
+					"full_waits=$(value full_waits "$log")" \
+					"fill_avg=$(value fill_avg "$log")" \
+					"cb_jitter_us=$(value cb_jitter_us "$log")"
+			done
+		done
+	done
+done
+
+$MAKE -s clean-bench
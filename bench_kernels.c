@@ -0,0 +1,141 @@
+/* Time every conversion kernel the CPU supports, one UNROLL_FACTOR
+ * block at a time like the pipeline runs them. Prints one line of
+ * key=value pairs per kernel and format.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "convert.h"
+#include "stats.h"
+
+/* Run every kernel at least this long */
+#define BENCH_NS			50000000ULL
+
+/* The kernels that get timed */
+#define OP_PEAK				0
+#define OP_POWER			1
+#define OP_SCALE			2	/* With a gain ramp */
+#define OP_FIXED			3	/* Without */
+#define OP_DSP				4	/* Every DSP stage and a ramp */
+#define OP_TO_FLOAT			5
+#define OP_COUNT			6
+
+static const char *op_names[OP_COUNT] = {
+	"peak", "power", "scale", "fixed", "dsp", "to_float"
+};
+
+static volatile float sink;
+
+
+/* Something like a tone at half scale in every format, so the
+ * kernels see realistic values and no denormals */
+static void bench_input(unsigned int format, void *in, unsigned int n)
+{
+	unsigned int m;
+
+	for(m = 0; m < n * 2; m++)
+	{
+		float v = 0.5f * sinf(0.01f * m + (m & 1) * 1.5707963f);
+
+		switch(format) {
+			case FORMAT_CF32: ((float *)in)[m] = v; break;
+			case FORMAT_CS16: ((int16_t *)in)[m] = v * 32767.f; break;
+			case FORMAT_CS8: ((int8_t *)in)[m] = v * 127.f; break;
+			case FORMAT_CU8: ((uint8_t *)in)[m] = v * 127.f + 127.5f; break;
+			case FORMAT_Q12: ((int16_t *)in)[m] = v * Q12_SCALE; break;
+		}
+	}
+}
+
+static void bench_run(const struct kernel_s *k, unsigned int op,
+		const struct dsp_s *dsp, const void *in, int16_t *out, float *fout,
+		unsigned int n)
+{
+	switch(op) {
+		case OP_PEAK: sink = k->peak(in, n); break;
+		case OP_POWER: sink = k->power(in, n); break;
+		case OP_SCALE: k->scale(in, out, n, 0.5f, 1e-6f); break;
+		case OP_FIXED: k->scale_fixed(in, out, n, 0.5f, 0.f); break;
+		case OP_DSP:
+			k->scale_dsp[1][dsp->stages](in, out, n, 0.5f, 1e-6f, dsp, 0);
+			break;
+		case OP_TO_FLOAT: k->to_float(in, fout, n); break;
+	}
+}
+
+int main(void)
+{
+	const unsigned int n = UNROLL_FACTOR;
+	const struct kernel_s *k;
+	struct dsp_s dsp;
+	unsigned long long t, reps;
+	unsigned int format, op, s;
+	void *in = NULL;
+	int16_t *out = NULL;
+	float *fout = NULL;
+	int ret = EXIT_FAILURE;
+
+	/* All the stages on, the table of the NCO is one block long */
+	memset(&dsp, 0, sizeof(dsp));
+	dsp.dc_i = 0.01f;
+	dsp.dc_q = -0.01f;
+	dsp.iq_gain = 1.05f;
+	dsp.iq_phase = 2.f;
+	dsp.freq = 123457;
+
+	if(dsp_init(&dsp, 10000000))
+		goto out;
+
+	in = malloc((size_t)n * 2 * sizeof(float));
+	out = malloc((size_t)n * 2 * sizeof(int16_t));
+	fout = malloc((size_t)n * 2 * sizeof(float));
+	if(!in || !out || !fout)
+	{
+		fprintf(stderr, "Error allocating buffers.\n");
+		goto out;
+	}
+
+	for(format = 0; format < FORMAT_COUNT; format++)
+	{
+		bench_input(format, in, n);
+
+		for(s = 0; (k = kernel_list(format, s)); s++)
+		{
+			for(op = 0; op < OP_COUNT; op++)
+			{
+				/* Warm up the caches, then as often as fits */
+				bench_run(k, op, &dsp, in, out, fout, n);
+
+				t = stats_now();
+				reps = 0;
+
+				do {
+					bench_run(k, op, &dsp, in, out, fout, n);
+					reps++;
+				} while(stats_now() - t < BENCH_NS);
+
+				t = stats_now() - t;
+
+				printf("kernel: isa=%s format=%s op=%s block=%u "
+					"ns_per_sample=%.3f msps=%.1f\n",
+					k->name,
+					formats[format].name,
+					op_names[op],
+					n,
+					(double)t / (reps * n),
+					reps * n * 1e3 / t);
+			}
+		}
+	}
+
+	ret = EXIT_SUCCESS;
+
+out:
+	dsp_free(&dsp);
+	free(in);
+	free(out);
+	free(fout);
+
+	return ret;
+}
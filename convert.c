@@ -0,0 +1,1359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86
+#endif
+
+#if defined(__aarch64__) || defined(__arm__)
+#include <sys/auxv.h>
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+#define TARGET_AVX2			__attribute__((target("avx2")))
+#define TARGET_AVX512		__attribute__((target("avx512f")))
+
+/* 32 bit ARM builds usually don't enable NEON, only the kernels
+ * need it and they are only used if the CPU says so */
+#if defined(__arm__) && !defined(__ARM_NEON)
+#define TARGET_NEON			__attribute__((target("fpu=neon")))
+#else
+#define TARGET_NEON
+#endif
+
+
+const struct format_s formats[FORMAT_COUNT] = {
+	{ "cf32", 2 * sizeof(float) },
+	{ "cs16", 2 * sizeof(int16_t) },
+	{ "cs8", 2 * sizeof(int8_t) },
+	{ "cu8", 2 * sizeof(uint8_t) },
+	{ "q12", 2 * sizeof(int16_t) }
+};
+
+/* Integer formats to float in [-1, 1) */
+#define CS16_TO_FLOAT(x)	((float)(x) * (1.f / 32768.f))
+#define CS8_TO_FLOAT(x)		((float)(x) * (1.f / 128.f))
+#define CU8_TO_FLOAT(x)		(((float)(x) - 127.5f) * (1.f / 128.f))
+#define Q12_TO_FLOAT(x)		((float)(x) * (1.f / Q12_SCALE))
+#define CF32_TO_FLOAT(x)	(x)
+
+static void dsp_phase(const struct dsp_s *dsp, unsigned long long index,
+		float *zi, float *zq);
+
+/* The integer formats are simple enough to leave the vectorization
+ * to the compiler, these get built once per instruction set
+ */
+#define INT_KERNELS(fmt, type, to_float, target, isa)					\
+target static float peak_##fmt##_##isa(const void *src, unsigned int n)	\
+{																		\
+	const type *in = src;												\
+	unsigned int m;														\
+	float peak = 0.f;													\
+																		\
+	for(m = 0; m < n; m++)												\
+	{																	\
+		float i = to_float(in[m * 2]);									\
+		float q = to_float(in[m * 2 + 1]);								\
+		float s = i * i + q * q;										\
+																		\
+		peak = s > peak ? s : peak;										\
+	}																	\
+																		\
+	return peak;														\
+}																		\
+																		\
+target static float power_##fmt##_##isa(const void *src, unsigned int n)	\
+{																		\
+	const type *in = src;												\
+	unsigned int m;														\
+	float sum = 0.f;													\
+																		\
+	for(m = 0; m < n * 2; m++)											\
+		sum += to_float(in[m]) * to_float(in[m]);						\
+																		\
+	return sum;															\
+}																		\
+																		\
+target static void scale_##fmt##_##isa(									\
+		const void *__restrict__ src,									\
+		int16_t *__restrict__ out,										\
+		unsigned int n,													\
+		float gain,														\
+		float step)														\
+{																		\
+	const type *__restrict__ in = src;									\
+	unsigned int m;														\
+	const float g = gain * Q12_SCALE;									\
+	const float d = step * Q12_SCALE;									\
+																		\
+	for(m = 0; m < n * 2; m++)											\
+	{																	\
+		float v = to_float(in[m]) * (g + d * (float)(m >> 1));			\
+																		\
+		v = v > 32767.f ? 32767.f : v;									\
+		v = v < -32768.f ? -32768.f : v;								\
+																		\
+		out[m] = (int16_t)((int32_t)v);									\
+	}																	\
+}																		\
+																		\
+target static void to_float_##fmt##_##isa(								\
+		const void *__restrict__ src,									\
+		float *__restrict__ out,										\
+		unsigned int n)													\
+{																		\
+	const type *__restrict__ in = src;									\
+	unsigned int m;														\
+																		\
+	for(m = 0; m < n * 2; m++)											\
+		out[m] = to_float(in[m]);										\
+}
+
+#define ALL_INT_KERNELS(target, isa)									\
+	INT_KERNELS(cs16, int16_t, CS16_TO_FLOAT, target, isa)				\
+	INT_KERNELS(cs8, int8_t, CS8_TO_FLOAT, target, isa)					\
+	INT_KERNELS(cu8, uint8_t, CU8_TO_FLOAT, target, isa)				\
+	INT_KERNELS(q12, int16_t, Q12_TO_FLOAT, target, isa)
+
+/* Blocks without a gain ramp, that is every block with the AGC off
+ * and most of them with it on. Without the per sample gain this is
+ * one multiply and a clamp, simple enough for the compiler in every
+ * format including float.
+ */
+#define FIXED_KERNEL(fmt, type, to_float, target, isa)					\
+target static void scale_fixed_##fmt##_##isa(							\
+		const void *__restrict__ src,									\
+		int16_t *__restrict__ out,										\
+		unsigned int n,													\
+		float gain,														\
+		float step)														\
+{																		\
+	const type *__restrict__ in = src;									\
+	unsigned int m;														\
+	const float g = gain * Q12_SCALE;									\
+																		\
+	(void)step;															\
+																		\
+	for(m = 0; m < n * 2; m++)											\
+	{																	\
+		float v = to_float(in[m]) * g;									\
+																		\
+		v = v > 32767.f ? 32767.f : v;									\
+		v = v < -32768.f ? -32768.f : v;								\
+																		\
+		out[m] = (int16_t)((int32_t)v);									\
+	}																	\
+}
+
+#define ALL_FIXED_KERNELS(target, isa)									\
+	FIXED_KERNEL(cf32, float, CF32_TO_FLOAT, target, isa)				\
+	FIXED_KERNEL(cs16, int16_t, CS16_TO_FLOAT, target, isa)				\
+	FIXED_KERNEL(cs8, int8_t, CS8_TO_FLOAT, target, isa)				\
+	FIXED_KERNEL(cu8, uint8_t, CU8_TO_FLOAT, target, isa)				\
+	FIXED_KERNEL(q12, int16_t, Q12_TO_FLOAT, target, isa)
+
+/* The DSP chain in front of the scaling for every format. stages
+ * and ramp are constants in each variant built from this, so whatever
+ * is off compiles out and the rest vectorizes like the plain kernels.
+ * That takes a size_t index, or m * 2 may wrap, and an int for the
+ * ramp, 64 bit integers don't convert to float in vectors.
+ */
+#define DSP_KERNEL(fmt, type, to_float, target, isa)					\
+target static inline __attribute__((always_inline))						\
+void dsp_##fmt##_##isa(													\
+		const void *__restrict__ src,									\
+		int16_t *__restrict__ out,										\
+		unsigned int n,													\
+		float gain,														\
+		float step,														\
+		const struct dsp_s *dsp,										\
+		unsigned long long index,										\
+		const unsigned int stages,										\
+		const bool ramp)												\
+{																		\
+	const type *__restrict__ in = src;									\
+	const float *__restrict__ nco = dsp->nco;							\
+	const float dc_i = dsp->dc_i, dc_q = dsp->dc_q;						\
+	const float iq_a = dsp->iq_a, iq_b = dsp->iq_b;						\
+	const float g = gain * Q12_SCALE;									\
+	const float d = step * Q12_SCALE;									\
+	float zi = 1.f, zq = 0.f;											\
+	size_t m;															\
+																		\
+	/* Where the NCO is at the first sample, the table goes on */		\
+	if(stages & DSP_NCO)												\
+		dsp_phase(dsp, index, &zi, &zq);								\
+																		\
+	for(m = 0; m < n; m++)												\
+	{																	\
+		float i = to_float(in[m * 2]);									\
+		float q = to_float(in[m * 2 + 1]);								\
+		float a = ramp ? g + d * (float)(int)m : g;						\
+																		\
+		if(stages & DSP_DC)												\
+		{																\
+			i -= dc_i;													\
+			q -= dc_q;													\
+		}																\
+																		\
+		if(stages & DSP_IQ)												\
+			q = iq_a * q + iq_b * i;									\
+																		\
+		if(stages & DSP_NCO)											\
+		{																\
+			float ri = zi * nco[m * 2] - zq * nco[m * 2 + 1];			\
+			float rq = zi * nco[m * 2 + 1] + zq * nco[m * 2];			\
+			float t = i * ri - q * rq;									\
+																		\
+			q = i * rq + q * ri;										\
+			i = t;														\
+		}																\
+																		\
+		i *= a;															\
+		q *= a;															\
+		i = i > 32767.f ? 32767.f : i;									\
+		i = i < -32768.f ? -32768.f : i;								\
+		q = q > 32767.f ? 32767.f : q;									\
+		q = q < -32768.f ? -32768.f : q;								\
+																		\
+		out[m * 2] = (int16_t)((int32_t)i);								\
+		out[m * 2 + 1] = (int16_t)((int32_t)q);							\
+	}																	\
+}																		\
+																		\
+DSP_VARIANT(fmt, target, isa, 1)										\
+DSP_VARIANT(fmt, target, isa, 2)										\
+DSP_VARIANT(fmt, target, isa, 3)										\
+DSP_VARIANT(fmt, target, isa, 4)										\
+DSP_VARIANT(fmt, target, isa, 5)										\
+DSP_VARIANT(fmt, target, isa, 6)										\
+DSP_VARIANT(fmt, target, isa, 7)
+
+#define DSP_VARIANT(fmt, target, isa, v)								\
+target static void scale_dsp_##fmt##_##isa##_##v(						\
+		const void *__restrict__ src,									\
+		int16_t *__restrict__ out,										\
+		unsigned int n,													\
+		float gain,														\
+		float step,														\
+		const struct dsp_s *dsp,										\
+		unsigned long long index)										\
+{																		\
+	dsp_##fmt##_##isa(src, out, n, gain, step, dsp, index, v, true);	\
+}																		\
+																		\
+target static void scale_dsp_fixed_##fmt##_##isa##_##v(					\
+		const void *__restrict__ src,									\
+		int16_t *__restrict__ out,										\
+		unsigned int n,													\
+		float gain,														\
+		float step,														\
+		const struct dsp_s *dsp,										\
+		unsigned long long index)										\
+{																		\
+	dsp_##fmt##_##isa(src, out, n, gain, step, dsp, index, v, false);	\
+}
+
+#define ALL_DSP_KERNELS(target, isa)									\
+	DSP_KERNEL(cf32, float, CF32_TO_FLOAT, target, isa)					\
+	DSP_KERNEL(cs16, int16_t, CS16_TO_FLOAT, target, isa)				\
+	DSP_KERNEL(cs8, int8_t, CS8_TO_FLOAT, target, isa)					\
+	DSP_KERNEL(cu8, uint8_t, CU8_TO_FLOAT, target, isa)					\
+	DSP_KERNEL(q12, int16_t, Q12_TO_FLOAT, target, isa)
+
+#define DSP_ROW(fmt, isa, kind) {										\
+	NULL,																\
+	scale_##kind##_##fmt##_##isa##_1,									\
+	scale_##kind##_##fmt##_##isa##_2,									\
+	scale_##kind##_##fmt##_##isa##_3,									\
+	scale_##kind##_##fmt##_##isa##_4,									\
+	scale_##kind##_##fmt##_##isa##_5,									\
+	scale_##kind##_##fmt##_##isa##_6,									\
+	scale_##kind##_##fmt##_##isa##_7									\
+}
+
+#define DSP_TABLE(fmt, isa) {											\
+	DSP_ROW(fmt, isa, dsp_fixed),										\
+	DSP_ROW(fmt, isa, dsp)												\
+}
+
+/* One kernel set per instruction set, indexed by format. The fixed
+ * gain and DSP kernels are compiler vectorized like the integer ones,
+ * vec says which build of them goes with the set. */
+#define KERNEL_SET(isa, vec, name, f_peak, f_power, f_scale)			\
+static const struct kernel_s kernels_##isa[FORMAT_COUNT] = {			\
+	{ name, f_peak, f_power, f_scale, scale_fixed_cf32_##vec,			\
+		DSP_TABLE(cf32, vec), to_float_cf32, resample_##isa },			\
+	{ name, peak_cs16_##isa, power_cs16_##isa, scale_cs16_##isa,		\
+		scale_fixed_cs16_##vec, DSP_TABLE(cs16, vec),					\
+		to_float_cs16_##isa, resample_##isa },							\
+	{ name, peak_cs8_##isa, power_cs8_##isa, scale_cs8_##isa,			\
+		scale_fixed_cs8_##vec, DSP_TABLE(cs8, vec),						\
+		to_float_cs8_##isa, resample_##isa },							\
+	{ name, peak_cu8_##isa, power_cu8_##isa, scale_cu8_##isa,			\
+		scale_fixed_cu8_##vec, DSP_TABLE(cu8, vec),						\
+		to_float_cu8_##isa, resample_##isa },							\
+	{ name, peak_q12_##isa, power_q12_##isa, scale_q12_##isa,			\
+		scale_fixed_q12_##vec, DSP_TABLE(q12, vec),						\
+		to_float_q12_##isa, resample_##isa }							\
+}
+
+/* The polyphase loop around a dot product of one branch with the
+ * input under it, two floats (I and Q) out. The branch advances by
+ * down per output sample, the input by whatever wraps over up.
+ */
+#define RESAMPLE_KERNEL(target, isa)									\
+target static void resample_##isa(struct resampler_s *rs, float *out,	\
+		unsigned int n)													\
+{																		\
+	const unsigned int len = 2 * rs->taps;								\
+	const unsigned int skip = rs->down / rs->up;						\
+	const unsigned int frac = rs->down % rs->up;						\
+	unsigned int m;														\
+																		\
+	for(m = 0; m < n; m++)												\
+	{																	\
+		dot_##isa(&rs->hist[2 * rs->pos], &rs->coefs[rs->phase * len],	\
+			len, &out[2 * m]);											\
+																		\
+		rs->pos += skip;												\
+		rs->phase += frac;												\
+		if(rs->phase >= rs->up)											\
+		{																\
+			rs->phase -= rs->up;										\
+			rs->pos++;													\
+		}																\
+	}																	\
+}
+
+
+/* Plain C, also handles the tails of the vector kernels
+ */
+static float peak_scalar(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	float peak = 0.f;
+
+	for(m = 0; m < n; m++)
+	{
+		float s = in[m * 2] * in[m * 2] + in[m * 2 + 1] * in[m * 2 + 1];
+
+		peak = s > peak ? s : peak;
+	}
+
+	return peak;
+}
+
+static float power_scalar(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	float sum = 0.f;
+
+	for(m = 0; m < n * 2; m++)
+		sum += in[m] * in[m];
+
+	return sum;
+}
+
+static void scale_scalar(
+		const void *__restrict__ src,
+		int16_t *__restrict__ out,
+		unsigned int n,
+		float gain,
+		float step)
+{
+	const float *__restrict__ in = src;
+	unsigned int m;
+	const float g = gain * Q12_SCALE;
+	const float d = step * Q12_SCALE;
+
+	/* Saturate like the vector kernels do */
+	for(m = 0; m < n * 2; m++)
+	{
+		float v = in[m] * (g + d * (float)(m >> 1));
+
+		v = v > 32767.f ? 32767.f : v;
+		v = v < -32768.f ? -32768.f : v;
+
+		out[m] = (int16_t)((int32_t)v);
+	}
+}
+
+/* Already float, for every instruction set */
+static void to_float_cf32(
+		const void *__restrict__ src,
+		float *__restrict__ out,
+		unsigned int n)
+{
+	memcpy(out, src, n * 2 * sizeof(float));
+}
+
+static inline void dot_scalar(const float *x, const float *c,
+		unsigned int len, float *out)
+{
+	unsigned int m;
+	float i = 0.f, q = 0.f;
+
+	for(m = 0; m < len; m += 2)
+	{
+		i += x[m] * c[m];
+		q += x[m + 1] * c[m + 1];
+	}
+
+	out[0] = i;
+	out[1] = q;
+}
+
+RESAMPLE_KERNEL(, scalar)
+ALL_INT_KERNELS(, scalar)
+ALL_FIXED_KERNELS(, scalar)
+ALL_DSP_KERNELS(, scalar)
+KERNEL_SET(scalar, scalar, "scalar", peak_scalar, power_scalar, scale_scalar);
+
+
+#ifdef HAVE_X86
+/* SSE2 is part of x86-64 anyway and has all we need,
+ * 4 samples per iteration
+ */
+__attribute__((target("sse2")))
+static float peak_sse2(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	__m128 peak = _mm_setzero_ps();
+	float res[4];
+
+	for(m = 0; m + 4 <= n; m += 4)
+	{
+		__m128 a = _mm_loadu_ps(&in[m * 2]);
+		__m128 b = _mm_loadu_ps(&in[m * 2 + 4]);
+
+		/* i*i + q*q ends up in both lanes of each pair */
+		a = _mm_mul_ps(a, a);
+		b = _mm_mul_ps(b, b);
+		a = _mm_add_ps(a, _mm_shuffle_ps(a, a, 0xb1));
+		b = _mm_add_ps(b, _mm_shuffle_ps(b, b, 0xb1));
+
+		peak = _mm_max_ps(peak, _mm_max_ps(a, b));
+	}
+
+	_mm_storeu_ps(res, peak);
+	res[0] = res[0] > res[2] ? res[0] : res[2];
+	res[1] = res[1] > res[3] ? res[1] : res[3];
+	res[0] = res[0] > res[1] ? res[0] : res[1];
+
+	res[1] = peak_scalar(&in[m * 2], n - m);
+
+	return res[0] > res[1] ? res[0] : res[1];
+}
+
+__attribute__((target("sse2")))
+static float power_sse2(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	__m128 sum = _mm_setzero_ps();
+	float res[4];
+
+	for(m = 0; m + 2 <= n; m += 2)
+	{
+		__m128 a = _mm_loadu_ps(&in[m * 2]);
+
+		sum = _mm_add_ps(sum, _mm_mul_ps(a, a));
+	}
+
+	_mm_storeu_ps(res, sum);
+
+	return res[0] + res[1] + res[2] + res[3]
+		+ power_scalar(&in[m * 2], n - m);
+}
+
+__attribute__((target("sse2")))
+static void scale_sse2(
+		const void *__restrict__ src,
+		int16_t *__restrict__ out,
+		unsigned int n,
+		float gain,
+		float step)
+{
+	const float *__restrict__ in = src;
+	unsigned int m;
+	const __m128 g = _mm_set1_ps(gain * Q12_SCALE);
+	const __m128 d = _mm_set1_ps(step * Q12_SCALE);
+	const __m128 idx_a = _mm_set_ps(1.f, 1.f, 0.f, 0.f);
+	const __m128 idx_b = _mm_set_ps(3.f, 3.f, 2.f, 2.f);
+
+	for(m = 0; m + 4 <= n; m += 4)
+	{
+		/* Gain ramp, same value for I and Q of a sample */
+		__m128 pos = _mm_set1_ps((float)m);
+		__m128 ga = _mm_add_ps(g, _mm_mul_ps(d, _mm_add_ps(pos, idx_a)));
+		__m128 gb = _mm_add_ps(g, _mm_mul_ps(d, _mm_add_ps(pos, idx_b)));
+
+		__m128i a = _mm_cvttps_epi32(
+			_mm_mul_ps(_mm_loadu_ps(&in[m * 2]), ga));
+		__m128i b = _mm_cvttps_epi32(
+			_mm_mul_ps(_mm_loadu_ps(&in[m * 2 + 4]), gb));
+
+		_mm_storeu_si128((__m128i *)&out[m * 2], _mm_packs_epi32(a, b));
+	}
+
+	scale_scalar(&in[m * 2], &out[m * 2], n - m, gain + step * m, step);
+}
+
+/* Anything built without target attribute is SSE2 already */
+#define peak_cs16_sse2		peak_cs16_scalar
+#define power_cs16_sse2		power_cs16_scalar
+#define scale_cs16_sse2		scale_cs16_scalar
+#define peak_cs8_sse2		peak_cs8_scalar
+#define power_cs8_sse2		power_cs8_scalar
+#define scale_cs8_sse2		scale_cs8_scalar
+#define peak_cu8_sse2		peak_cu8_scalar
+#define power_cu8_sse2		power_cu8_scalar
+#define scale_cu8_sse2		scale_cu8_scalar
+#define peak_q12_sse2		peak_q12_scalar
+#define power_q12_sse2		power_q12_scalar
+#define scale_q12_sse2		scale_q12_scalar
+#define to_float_cs16_sse2	to_float_cs16_scalar
+#define to_float_cs8_sse2	to_float_cs8_scalar
+#define to_float_cu8_sse2	to_float_cu8_scalar
+#define to_float_q12_sse2	to_float_q12_scalar
+
+/* 4 taps per iteration, on two accumulators, even lanes are I */
+__attribute__((target("sse2")))
+static inline void dot_sse2(const float *x, const float *c,
+		unsigned int len, float *out)
+{
+	unsigned int m;
+	__m128 a = _mm_setzero_ps();
+	__m128 b = _mm_setzero_ps();
+	float res[4];
+
+	for(m = 0; m < len; m += 8)
+	{
+		a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(&x[m]),
+			_mm_loadu_ps(&c[m])));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(&x[m + 4]),
+			_mm_loadu_ps(&c[m + 4])));
+	}
+
+	_mm_storeu_ps(res, _mm_add_ps(a, b));
+	out[0] = res[0] + res[2];
+	out[1] = res[1] + res[3];
+}
+
+RESAMPLE_KERNEL(__attribute__((target("sse2"))), sse2)
+KERNEL_SET(sse2, scalar, "sse2", peak_sse2, power_sse2, scale_sse2);
+
+
+/* 8 samples per iteration
+ */
+TARGET_AVX2
+static float peak_avx2(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	__m256 peak = _mm256_setzero_ps();
+	__m128 p;
+	float res[2];
+
+	for(m = 0; m + 8 <= n; m += 8)
+	{
+		__m256 a = _mm256_loadu_ps(&in[m * 2]);
+		__m256 b = _mm256_loadu_ps(&in[m * 2 + 8]);
+
+		a = _mm256_mul_ps(a, a);
+		b = _mm256_mul_ps(b, b);
+		a = _mm256_add_ps(a, _mm256_permute_ps(a, 0xb1));
+		b = _mm256_add_ps(b, _mm256_permute_ps(b, 0xb1));
+
+		peak = _mm256_max_ps(peak, _mm256_max_ps(a, b));
+	}
+
+	p = _mm_max_ps(_mm256_castps256_ps128(peak),
+		_mm256_extractf128_ps(peak, 1));
+	p = _mm_max_ps(p, _mm_movehl_ps(p, p));
+	res[0] = _mm_cvtss_f32(p);
+	res[1] = peak_scalar(&in[m * 2], n - m);
+
+	return res[0] > res[1] ? res[0] : res[1];
+}
+
+TARGET_AVX2
+static float power_avx2(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	__m256 sum = _mm256_setzero_ps();
+	__m128 p;
+
+	for(m = 0; m + 4 <= n; m += 4)
+	{
+		__m256 a = _mm256_loadu_ps(&in[m * 2]);
+
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(a, a));
+	}
+
+	p = _mm_add_ps(_mm256_castps256_ps128(sum),
+		_mm256_extractf128_ps(sum, 1));
+	p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+	p = _mm_add_ss(p, _mm_shuffle_ps(p, p, 0x55));
+
+	return _mm_cvtss_f32(p) + power_scalar(&in[m * 2], n - m);
+}
+
+TARGET_AVX2
+static void scale_avx2(
+		const void *__restrict__ src,
+		int16_t *__restrict__ out,
+		unsigned int n,
+		float gain,
+		float step)
+{
+	const float *__restrict__ in = src;
+	unsigned int m;
+	const __m256 g = _mm256_set1_ps(gain * Q12_SCALE);
+	const __m256 d = _mm256_set1_ps(step * Q12_SCALE);
+	const __m256 idx_a = _mm256_set_ps(3.f, 3.f, 2.f, 2.f, 1.f, 1.f, 0.f, 0.f);
+	const __m256 idx_b = _mm256_set_ps(7.f, 7.f, 6.f, 6.f, 5.f, 5.f, 4.f, 4.f);
+
+	for(m = 0; m + 8 <= n; m += 8)
+	{
+		__m256 pos = _mm256_set1_ps((float)m);
+		__m256 ga = _mm256_add_ps(g,
+			_mm256_mul_ps(d, _mm256_add_ps(pos, idx_a)));
+		__m256 gb = _mm256_add_ps(g,
+			_mm256_mul_ps(d, _mm256_add_ps(pos, idx_b)));
+
+		__m256i a = _mm256_cvttps_epi32(
+			_mm256_mul_ps(_mm256_loadu_ps(&in[m * 2]), ga));
+		__m256i b = _mm256_cvttps_epi32(
+			_mm256_mul_ps(_mm256_loadu_ps(&in[m * 2 + 8]), gb));
+
+		/* Packing works per 128 bit lane, put them back in order */
+		__m256i p = _mm256_permute4x64_epi64(
+			_mm256_packs_epi32(a, b), 0xd8);
+
+		_mm256_storeu_si256((__m256i *)&out[m * 2], p);
+	}
+
+	scale_scalar(&in[m * 2], &out[m * 2], n - m, gain + step * m, step);
+}
+
+/* 8 taps per iteration */
+TARGET_AVX2
+static inline void dot_avx2(const float *x, const float *c,
+		unsigned int len, float *out)
+{
+	unsigned int m;
+	__m256 a = _mm256_setzero_ps();
+	__m256 b = _mm256_setzero_ps();
+	__m128 p;
+
+	for(m = 0; m < len; m += 16)
+	{
+		a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(&x[m]),
+			_mm256_loadu_ps(&c[m])));
+		b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_loadu_ps(&x[m + 8]),
+			_mm256_loadu_ps(&c[m + 8])));
+	}
+
+	a = _mm256_add_ps(a, b);
+	p = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+	p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+
+	_mm_storel_pi((__m64 *)out, p);
+}
+
+RESAMPLE_KERNEL(TARGET_AVX2, avx2)
+ALL_INT_KERNELS(TARGET_AVX2, avx2)
+ALL_FIXED_KERNELS(TARGET_AVX2, avx2)
+ALL_DSP_KERNELS(TARGET_AVX2, avx2)
+KERNEL_SET(avx2, avx2, "avx2", peak_avx2, power_avx2, scale_avx2);
+
+
+/* 8 samples per iteration, but no lane shuffling for the packing
+ */
+TARGET_AVX512
+static float peak_avx512(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	__m512 peak = _mm512_setzero_ps();
+	float res[2];
+
+	for(m = 0; m + 8 <= n; m += 8)
+	{
+		__m512 a = _mm512_loadu_ps(&in[m * 2]);
+
+		a = _mm512_mul_ps(a, a);
+		a = _mm512_add_ps(a, _mm512_permute_ps(a, 0xb1));
+
+		peak = _mm512_max_ps(peak, a);
+	}
+
+	res[0] = _mm512_reduce_max_ps(peak);
+	res[1] = peak_scalar(&in[m * 2], n - m);
+
+	return res[0] > res[1] ? res[0] : res[1];
+}
+
+TARGET_AVX512
+static float power_avx512(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	__m512 sum = _mm512_setzero_ps();
+
+	for(m = 0; m + 8 <= n; m += 8)
+	{
+		__m512 a = _mm512_loadu_ps(&in[m * 2]);
+
+		sum = _mm512_add_ps(sum, _mm512_mul_ps(a, a));
+	}
+
+	return _mm512_reduce_add_ps(sum) + power_scalar(&in[m * 2], n - m);
+}
+
+TARGET_AVX512
+static void scale_avx512(
+		const void *__restrict__ src,
+		int16_t *__restrict__ out,
+		unsigned int n,
+		float gain,
+		float step)
+{
+	const float *__restrict__ in = src;
+	unsigned int m;
+	const __m512 g = _mm512_set1_ps(gain * Q12_SCALE);
+	const __m512 d = _mm512_set1_ps(step * Q12_SCALE);
+	const __m512 idx = _mm512_set_ps(7.f, 7.f, 6.f, 6.f, 5.f, 5.f, 4.f, 4.f,
+		3.f, 3.f, 2.f, 2.f, 1.f, 1.f, 0.f, 0.f);
+
+	for(m = 0; m + 8 <= n; m += 8)
+	{
+		__m512 ga = _mm512_add_ps(g, _mm512_mul_ps(d,
+			_mm512_add_ps(_mm512_set1_ps((float)m), idx)));
+
+		__m512i a = _mm512_cvttps_epi32(
+			_mm512_mul_ps(_mm512_loadu_ps(&in[m * 2]), ga));
+
+		_mm256_storeu_si256((__m256i *)&out[m * 2],
+			_mm512_cvtsepi32_epi16(a));
+	}
+
+	scale_scalar(&in[m * 2], &out[m * 2], n - m, gain + step * m, step);
+}
+
+/* 8 taps per iteration, that's all of them in 4 */
+TARGET_AVX512
+static inline void dot_avx512(const float *x, const float *c,
+		unsigned int len, float *out)
+{
+	unsigned int m;
+	__m512 a = _mm512_setzero_ps();
+	__m256 h;
+	__m128 p;
+
+	for(m = 0; m < len; m += 16)
+		a = _mm512_add_ps(a, _mm512_mul_ps(_mm512_loadu_ps(&x[m]),
+			_mm512_loadu_ps(&c[m])));
+
+	h = _mm256_add_ps(_mm512_castps512_ps256(a),
+		_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1)));
+	p = _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+	p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+
+	_mm_storel_pi((__m64 *)out, p);
+}
+
+RESAMPLE_KERNEL(TARGET_AVX512, avx512)
+ALL_INT_KERNELS(TARGET_AVX512, avx512)
+ALL_FIXED_KERNELS(TARGET_AVX512, avx512)
+ALL_DSP_KERNELS(TARGET_AVX512, avx512)
+KERNEL_SET(avx512, avx512, "avx512", peak_avx512, power_avx512, scale_avx512);
+#endif
+
+
+#ifdef HAVE_NEON
+/* 4 samples per iteration
+ */
+TARGET_NEON
+static float peak_neon(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	float32x4_t peak = vdupq_n_f32(0.f);
+	float32x2_t p;
+	float res[2];
+
+	for(m = 0; m + 4 <= n; m += 4)
+	{
+		float32x4_t a = vld1q_f32(&in[m * 2]);
+		float32x4_t b = vld1q_f32(&in[m * 2 + 4]);
+
+		a = vmulq_f32(a, a);
+		b = vmulq_f32(b, b);
+		a = vaddq_f32(a, vrev64q_f32(a));
+		b = vaddq_f32(b, vrev64q_f32(b));
+
+		peak = vmaxq_f32(peak, vmaxq_f32(a, b));
+	}
+
+	p = vpmax_f32(vget_low_f32(peak), vget_high_f32(peak));
+	p = vpmax_f32(p, p);
+	res[0] = vget_lane_f32(p, 0);
+	res[1] = peak_scalar(&in[m * 2], n - m);
+
+	return res[0] > res[1] ? res[0] : res[1];
+}
+
+TARGET_NEON
+static float power_neon(const void *src, unsigned int n)
+{
+	const float *in = src;
+	unsigned int m;
+	float32x4_t sum = vdupq_n_f32(0.f);
+	float32x2_t p;
+
+	for(m = 0; m + 2 <= n; m += 2)
+	{
+		float32x4_t a = vld1q_f32(&in[m * 2]);
+
+		sum = vmlaq_f32(sum, a, a);
+	}
+
+	p = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+	p = vpadd_f32(p, p);
+
+	return vget_lane_f32(p, 0) + power_scalar(&in[m * 2], n - m);
+}
+
+TARGET_NEON
+static void scale_neon(
+		const void *__restrict__ src,
+		int16_t *__restrict__ out,
+		unsigned int n,
+		float gain,
+		float step)
+{
+	const float *__restrict__ in = src;
+	static const float idx[8] = { 0.f, 0.f, 1.f, 1.f, 2.f, 2.f, 3.f, 3.f };
+	unsigned int m;
+	const float32x4_t g = vdupq_n_f32(gain * Q12_SCALE);
+	const float d = step * Q12_SCALE;
+	const float32x4_t idx_a = vld1q_f32(&idx[0]);
+	const float32x4_t idx_b = vld1q_f32(&idx[4]);
+
+	for(m = 0; m + 4 <= n; m += 4)
+	{
+		float32x4_t pos = vdupq_n_f32((float)m);
+		float32x4_t ga = vmlaq_n_f32(g, vaddq_f32(pos, idx_a), d);
+		float32x4_t gb = vmlaq_n_f32(g, vaddq_f32(pos, idx_b), d);
+
+		int32x4_t a = vcvtq_s32_f32(vmulq_f32(vld1q_f32(&in[m * 2]), ga));
+		int32x4_t b = vcvtq_s32_f32(vmulq_f32(vld1q_f32(&in[m * 2 + 4]), gb));
+
+		vst1q_s16(&out[m * 2], vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+
+	scale_scalar(&in[m * 2], &out[m * 2], n - m, gain + step * m, step);
+}
+
+/* 4 taps per iteration, on two accumulators */
+TARGET_NEON
+static inline void dot_neon(const float *x, const float *c,
+		unsigned int len, float *out)
+{
+	unsigned int m;
+	float32x4_t a = vdupq_n_f32(0.f);
+	float32x4_t b = vdupq_n_f32(0.f);
+	float32x2_t p;
+
+	for(m = 0; m < len; m += 8)
+	{
+		a = vmlaq_f32(a, vld1q_f32(&x[m]), vld1q_f32(&c[m]));
+		b = vmlaq_f32(b, vld1q_f32(&x[m + 4]), vld1q_f32(&c[m + 4]));
+	}
+
+	a = vaddq_f32(a, b);
+	p = vadd_f32(vget_low_f32(a), vget_high_f32(a));
+
+	vst1_f32(out, p);
+}
+
+RESAMPLE_KERNEL(TARGET_NEON, neon)
+ALL_INT_KERNELS(TARGET_NEON, neon)
+ALL_FIXED_KERNELS(TARGET_NEON, neon)
+ALL_DSP_KERNELS(TARGET_NEON, neon)
+KERNEL_SET(neon, neon, "neon", peak_neon, power_neon, scale_neon);
+#endif
+
+
+/* Ask the CPU what it can do, best first
+ */
+const struct kernel_s *kernel_list(unsigned int format, unsigned int n)
+{
+	const struct kernel_s *sets[5];
+	unsigned int num = 0;
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx512f"))
+		sets[num++] = kernels_avx512;
+	if(__builtin_cpu_supports("avx2"))
+		sets[num++] = kernels_avx2;
+	if(__builtin_cpu_supports("sse2"))
+		sets[num++] = kernels_sse2;
+#endif
+
+#ifdef HAVE_NEON
+#ifdef __aarch64__
+	if(getauxval(AT_HWCAP) & HWCAP_ASIMD)
+		sets[num++] = kernels_neon;
+#else
+	if(getauxval(AT_HWCAP) & HWCAP_ARM_NEON)
+		sets[num++] = kernels_neon;
+#endif
+#endif
+
+	sets[num++] = kernels_scalar;
+
+	return n < num ? &sets[n][format] : NULL;
+}
+
+/* Once at startup
+ */
+const struct kernel_s *kernel_select(unsigned int format)
+{
+	return kernel_list(format, 0);
+}
+
+/* Turn a time constant into a per block smoothing coefficient,
+ * 0ms means the gain follows immediately
+ */
+static float agc_coef(float ms, unsigned int samplerate)
+{
+	if(ms <= 0.f)
+		return 1.f;
+
+	return 1.f - expf(-(float)UNROLL_FACTOR * 1000.f / (ms * samplerate));
+}
+
+/* Set up the auto gain control, soft_gain must be set already
+ */
+void agc_init(struct agc_s *agc, unsigned int samplerate)
+{
+	agc->gain = agc->soft_gain;
+	agc->attack_coef = agc_coef(agc->attack, samplerate);
+
+	/* No release time means the gain is never raised again */
+	agc->release_coef = agc->release > 0.f ?
+		agc_coef(agc->release, samplerate) : 0.f;
+
+	agc->adjustments = 0;
+	agc->reported = 0;
+	agc->last_report = 0;
+}
+
+/* Without AGC the new gain applies right away. The AGC only takes
+ * a cut right away, a raise comes with the release time.
+ */
+void agc_set_gain(struct agc_s *agc, float soft_gain)
+{
+	agc->soft_gain = soft_gain;
+
+	if(agc->target <= 0.f || agc->gain > soft_gain)
+		agc->gain = soft_gain;
+}
+
+/* Report gain reductions at most once per second
+ */
+static void agc_report(struct agc_s *agc)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	if(now.tv_sec == agc->last_report)
+		return;
+
+	fprintf(stderr, "WARNING: Soft gain adjusted to %f "
+		"(%lu times, %lu since last report).\n",
+		agc->gain, agc->adjustments, agc->adjustments - agc->reported);
+
+	agc->reported = agc->adjustments;
+	agc->last_report = now.tv_sec;
+}
+
+/* Measure the level of the block and move the gain towards where
+ * the level says it should go, the block then gets a linear ramp
+ * from the returned gain with *step per sample
+ */
+float agc_update(
+		const struct kernel_s *k,
+		struct agc_s *agc,
+		const void *in,
+		unsigned int n,
+		float *step)
+{
+	float gain = agc->gain;
+	float next = gain;
+
+	/* Check if auto gain control is enabled */
+	if(agc->target > 0.f)
+	{
+		float want = agc->soft_gain;
+		float level = agc->rms ?
+			sqrtf(k->power(in, n) / n) :
+			sqrtf(k->peak(in, n));
+
+		/* Magnitude is over bounds with the gain we'd like to have */
+		if(level * want > agc->target)
+			want = agc->target / level;
+
+		if(want < gain)
+		{
+			next = gain + (want - gain) * agc->attack_coef;
+			agc->adjustments++;
+
+			/* Without attack time there is no ramp, this block
+			 * gets the reduced gain right away */
+			if(agc->attack_coef >= 1.f)
+				gain = next;
+		}
+		else
+			next = gain + (want - gain) * agc->release_coef;
+	}
+
+	*step = (next - gain) / n;
+	agc->gain = next;
+
+	if(agc->adjustments != agc->reported)
+		agc_report(agc);
+
+	return gain;
+}
+
+void scale_and_autogain(
+		const struct kernel_s *k,
+		struct agc_s *agc,
+		const struct dsp_s *dsp,
+		unsigned long long index,
+		const void *__restrict__ in,
+		int16_t *__restrict__ out,
+		unsigned int n)
+{
+	float step;
+	float gain = agc_update(k, agc, in, n, &step);
+
+	/* Convert to int16 and write to output buffer */
+	kernel_scale(k, dsp, in, out, n, gain, step, index);
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while(b)
+	{
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* Zeroth order modified Bessel function, for the Kaiser window */
+static double bessel_i0(double x)
+{
+	double sum = 1., term = 1.;
+	unsigned int k;
+
+	for(k = 1; k < 50 && term > 1e-12 * sum; k++)
+	{
+		term *= (x / (2. * k)) * (x / (2. * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+/* Windowed sinc low pass at the lower of both Nyquist rates, cut
+ * into up branches. Every branch gets a DC gain of 1.
+ */
+int resampler_init(struct resampler_s *rs, unsigned int in_rate,
+		unsigned int out_rate)
+{
+	const double beta = 8.;
+	unsigned int g = gcd(in_rate, out_rate);
+	unsigned int n, j, len, num;
+	unsigned long long taps;
+	double fc, x, *h, sum;
+
+	memset(rs, 0, sizeof(*rs));
+
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+
+	if(rs->up > RESAMPLE_MAX_PHASES)
+	{
+		fprintf(stderr, "Can't resample %u to %u, that takes %u filter "
+			"branches (%u at most).\n", in_rate, out_rate, rs->up,
+			RESAMPLE_MAX_PHASES);
+		return -1;
+	}
+
+	/* The filter spans as much of the input per output sample as
+	 * without decimation, so the anti-aliasing holds up, and an
+	 * output sample never skips more input than is under the filter */
+	taps = (unsigned long long)RESAMPLE_TAPS
+		* ((rs->down + rs->up - 1) / rs->up);
+	if(taps > RESAMPLE_MAX_TAPS)
+	{
+		fprintf(stderr, "Can't resample %u to %u, decimating by %.1f takes "
+			"%llu taps per branch (%u at most).\n", in_rate, out_rate,
+			(double)rs->down / rs->up, taps, RESAMPLE_MAX_TAPS);
+		return -1;
+	}
+	rs->taps = taps;
+
+	num = rs->up * rs->taps;
+	len = 2 * rs->taps;
+
+	/* Relative to the rate in between, with some transition band */
+	fc = 0.45 / (rs->up > rs->down ? rs->up : rs->down);
+
+	h = malloc(num * sizeof(double));
+	rs->coefs = malloc((size_t)rs->up * len * sizeof(float));
+	rs->hist_size = rs->taps + UNROLL_FACTOR;
+	rs->hist = calloc(rs->hist_size, 2 * sizeof(float));
+	rs->block = malloc(UNROLL_FACTOR * 2 * sizeof(float));
+	if(!h || !rs->coefs || !rs->hist || !rs->block)
+	{
+		fprintf(stderr, "Error allocating resampler.\n");
+		free(h);
+		return -1;
+	}
+
+	for(n = 0; n < num; n++)
+	{
+		x = n - (num - 1) / 2.;
+		h[n] = 2. * fc * (x == 0. ? 1. : sin(2. * M_PI * fc * x)
+			/ (2. * M_PI * fc * x));
+
+		x = 2. * n / (num - 1) - 1.;
+		h[n] *= bessel_i0(beta * sqrt(1. - x * x)) / bessel_i0(beta);
+	}
+
+	/* Branch p gets taps p, p + up, ..., newest input first, so
+	 * reversed they line up with the input in memory */
+	for(n = 0; n < rs->up; n++)
+	{
+		for(j = 0, sum = 0.; j < rs->taps; j++)
+			sum += h[n + j * rs->up];
+
+		for(j = 0; j < rs->taps; j++)
+		{
+			float c = h[n + (rs->taps - 1 - j) * rs->up] / sum;
+
+			rs->coefs[n * len + 2 * j] = c;
+			rs->coefs[n * len + 2 * j + 1] = c;
+		}
+	}
+
+	free(h);
+
+	/* Start with silence under the filter, the first input sample
+	 * is the newest one then */
+	rs->len = rs->taps - 1;
+	rs->kernel = kernel_select(FORMAT_CF32);
+
+	return 0;
+}
+
+void resampler_free(struct resampler_s *rs)
+{
+	free(rs->coefs);
+	free(rs->hist);
+	free(rs->block);
+	rs->coefs = NULL;
+	rs->hist = NULL;
+	rs->block = NULL;
+}
+
+/* Output k needs input up to pos + (phase + k * down) / up + taps */
+size_t resampler_ready(const struct resampler_s *rs)
+{
+	unsigned long long room;
+
+	if(rs->pos + rs->taps > rs->len)
+		return 0;
+
+	room = (unsigned long long)(rs->len - rs->taps - rs->pos + 1) * rs->up;
+
+	return (room - rs->phase + rs->down - 1) / rs->down;
+}
+
+/* With nothing ready less than taps samples are left, so after
+ * moving them to the front a whole block fits */
+static float *resampler_room(struct resampler_s *rs, unsigned int n)
+{
+	if(rs->len + n > rs->hist_size)
+	{
+		memmove(rs->hist, &rs->hist[2 * rs->pos],
+			(rs->len - rs->pos) * 2 * sizeof(float));
+		rs->len -= rs->pos;
+		rs->pos = 0;
+	}
+
+	return &rs->hist[2 * rs->len];
+}
+
+void resampler_push(struct resampler_s *rs, const struct kernel_s *k,
+		const void *in, unsigned int n)
+{
+	k->to_float(in, resampler_room(rs, n), n);
+	rs->len += n;
+}
+
+void resampler_flush(struct resampler_s *rs)
+{
+	if(rs->flushed)
+		return;
+
+	memset(resampler_room(rs, rs->taps), 0, rs->taps * 2 * sizeof(float));
+	rs->len += rs->taps;
+	rs->flushed = true;
+}
+
+void resample_and_autogain(
+		struct resampler_s *rs,
+		struct agc_s *agc,
+		const struct dsp_s *dsp,
+		unsigned long long index,
+		int16_t *__restrict__ out,
+		unsigned int n)
+{
+	const struct kernel_s *k = rs->kernel;
+	float step, gain;
+
+	/* The block is still in cache for the level and the scaling */
+	k->resample(rs, rs->block, n);
+	gain = agc_update(k, agc, rs->block, n, &step);
+	kernel_scale(k, dsp, rs->block, out, n, gain, step, index);
+}
+
+/* The NCO phase at a sample, exact however long we run. Every
+ * sample moves it by nco_step / samplerate turns. */
+static void dsp_phase(const struct dsp_s *dsp, unsigned long long index,
+		float *zi, float *zq)
+{
+	unsigned long long k = index % dsp->samplerate * dsp->nco_step
+		% dsp->samplerate;
+	double phi = 2. * M_PI * k / dsp->samplerate;
+
+	*zi = cos(phi);
+	*zq = sin(phi);
+}
+
+int dsp_init(struct dsp_s *dsp, unsigned int samplerate)
+{
+	const double phi = dsp->iq_phase * M_PI / 180.;
+	long long step;
+	unsigned int m;
+
+	dsp->stages = 0;
+	dsp->nco = NULL;
+	dsp->samplerate = samplerate;
+
+	if(dsp->dc_i != 0.f || dsp->dc_q != 0.f)
+		dsp->stages |= DSP_DC;
+
+	/* The transmitter makes g * (Q cos phi + I sin phi) of Q */
+	if(dsp->iq_gain != 1.f || dsp->iq_phase != 0.f)
+	{
+		if(dsp->iq_gain <= 0.f || fabs(phi) >= M_PI / 2.)
+		{
+			fprintf(stderr, "IQ gain must be positive and the phase "
+				"error below 90 degrees.\n");
+			return -1;
+		}
+
+		dsp->iq_a = 1. / (dsp->iq_gain * cos(phi));
+		dsp->iq_b = -tan(phi);
+		dsp->stages |= DSP_IQ;
+	}
+
+	step = dsp->freq % (long long)samplerate;
+	if(step < 0)
+		step += samplerate;
+	dsp->nco_step = step;
+
+	if(step)
+	{
+		dsp->nco = malloc(UNROLL_FACTOR * 2 * sizeof(float));
+		if(!dsp->nco)
+		{
+			fprintf(stderr, "Error allocating NCO table.\n");
+			return -1;
+		}
+
+		/* Straight from the phase, so nothing adds up */
+		for(m = 0; m < UNROLL_FACTOR; m++)
+		{
+			double p = 2. * M_PI * (double)((m * (unsigned long long)step)
+				% samplerate) / samplerate;
+
+			dsp->nco[m * 2] = cos(p);
+			dsp->nco[m * 2 + 1] = sin(p);
+		}
+
+		dsp->stages |= DSP_NCO;
+	}
+
+	return 0;
+}
+
+void dsp_free(struct dsp_s *dsp)
+{
+	free(dsp->nco);
+	dsp->nco = NULL;
+}
+
+bool q12_quiet(const int16_t *in, size_t n, int level)
+{
+	/* Short stretches keep the loop vectorized and the early out
+	 * cheap for slots that aren't quiet */
+	const size_t stretch = 64;
+	size_t m, k, len;
+	int peak;
+
+	for(m = 0; m < 2 * n; m += stretch)
+	{
+		len = 2 * n - m < stretch ? 2 * n - m : stretch;
+		peak = 0;
+
+		for(k = 0; k < len; k++)
+		{
+			int v = in[m + k] < 0 ? -in[m + k] : in[m + k];
+
+			peak = v > peak ? v : peak;
+		}
+
+		if(peak > level)
+			return false;
+	}
+
+	return true;
+}
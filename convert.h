@@ -0,0 +1,244 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+
+/* This helps with loop unrolling and auto vectorization
+ * The higher you set this, the lower your overhead will be.
+ * The benchmark builds with other values to compare. */
+#ifndef UNROLL_FACTOR
+#define UNROLL_FACTOR		8192
+#endif
+
+/* Full scale of SC16_Q12 */
+#define Q12_SCALE			2047.f
+
+/* Resampler FIR taps per polyphase branch, a multiple of 8 so the
+ * vector kernels need no tail handling. Decimating takes as many
+ * times more as the ratio, up to RESAMPLE_MAX_TAPS. */
+#define RESAMPLE_TAPS		32
+#define RESAMPLE_MAX_TAPS	2048
+
+/* Most polyphase branches, that's the interpolation factor */
+#define RESAMPLE_MAX_PHASES	1024
+
+
+/* Input sample formats */
+#define FORMAT_CF32			0	/* float, full scale is 1.0 */
+#define FORMAT_CS16			1	/* int16, full scale is 32768 */
+#define FORMAT_CS8			2	/* int8 */
+#define FORMAT_CU8			3	/* uint8 with 127.5 offset (rtl_sdr) */
+#define FORMAT_Q12			4	/* What the device takes anyway */
+#define FORMAT_COUNT		5
+
+struct format_s
+{
+	const char *name;
+	unsigned int size;			/* Bytes per I/Q sample */
+};
+
+extern const struct format_s formats[FORMAT_COUNT];
+
+struct resampler_s;
+struct dsp_s;
+
+/* Corrections ahead of the gain, applied in this order */
+#define DSP_DC				1	/* Remove a DC offset */
+#define DSP_IQ				2	/* Pre-correct an IQ imbalance */
+#define DSP_NCO				4	/* Shift the frequency */
+#define DSP_VARIANTS		8	/* Every combination, 0 is none */
+
+
+/* One set of conversion kernels for one input format, all of them
+ * work on n interleaved I/Q samples. Magnitudes are relative to
+ * the format's full scale.
+ */
+struct kernel_s
+{
+	const char *name;
+
+	/* Largest squared magnitude i * i + q * q */
+	float (*peak)(const void *in, unsigned int n);
+
+	/* Sum of all squared magnitudes */
+	float (*power)(const void *in, unsigned int n);
+
+	/* Multiply by gain + m * step (m is the sample index) and
+	 * convert to SC16_Q12 */
+	void (*scale)(const void *__restrict__ in,
+		int16_t *__restrict__ out, unsigned int n, float gain, float step);
+
+	/* Same for a constant gain, step is ignored */
+	void (*scale_fixed)(const void *__restrict__ in,
+		int16_t *__restrict__ out, unsigned int n, float gain, float step);
+
+	/* Both with the DSP chain in front, [0] is the fixed gain, [1]
+	 * the ramp and then one kernel for each combination of stages
+	 * (0 is unused). index is the position of the first sample in
+	 * the input, for the NCO phase. */
+	void (*scale_dsp[2][DSP_VARIANTS])(const void *__restrict__ in,
+		int16_t *__restrict__ out, unsigned int n, float gain, float step,
+		const struct dsp_s *dsp, unsigned long long index);
+
+	/* Convert to float, full scale is 1.0 */
+	void (*to_float)(const void *__restrict__ in,
+		float *__restrict__ out, unsigned int n);
+
+	/* Run the resampler FIR for n output samples (float in and out,
+	 * the same for every format) */
+	void (*resample)(struct resampler_s *rs, float *out, unsigned int n);
+};
+
+/* Auto gain control, the level is measured once per
+ * UNROLL_FACTOR block
+ */
+struct agc_s
+{
+	float gain;					/* Current soft gain */
+	float soft_gain;			/* Configured soft gain, never exceeded */
+	float target;				/* Auto gain setting, 0 is off */
+	float attack;				/* Attack time in ms */
+	float release;				/* Release time in ms, 0 holds the gain */
+	bool rms;					/* RMS instead of peak detector */
+	float attack_coef;			/* Per block smoothing coefficients */
+	float release_coef;
+	unsigned long adjustments;	/* Number of gain reductions */
+	unsigned long reported;		/* ...when we last told the user */
+	time_t last_report;
+};
+
+/* DC offset, IQ imbalance and frequency shift
+ */
+struct dsp_s
+{
+	unsigned int stages;		/* DSP_* that are on */
+	float dc_i;					/* DC offset to remove, full scale 1.0 */
+	float dc_q;
+	float iq_gain;				/* Q amplitude relative to I */
+	float iq_phase;				/* Q phase error in degrees */
+	float iq_a;					/* Q' = iq_a * Q + iq_b * I */
+	float iq_b;
+	int freq;					/* Frequency shift in Hz */
+	unsigned int samplerate;
+	unsigned long long nco_step;	/* freq mod samplerate, positive */
+	float *nco;					/* cos and sin of one block of steps */
+};
+
+/* Rational polyphase resampler, out rate / in rate = up / down
+ * The input is kept as float with enough history for the filter,
+ * the output is converted one block at a time while it's in cache.
+ */
+struct resampler_s
+{
+	unsigned int up;			/* Interpolation factor */
+	unsigned int down;			/* Decimation factor */
+	unsigned int taps;			/* FIR taps per branch */
+	float *coefs;				/* Per branch, oldest sample first, the
+								 * same tap for I and Q next to each other */
+	float *hist;				/* Input as float */
+	size_t hist_size;			/* ...room in samples */
+	size_t len;					/* Samples in hist */
+	size_t pos;					/* Oldest sample under the filter */
+	unsigned int phase;			/* Current branch */
+	float *block;				/* One block of output before scaling */
+	const struct kernel_s *kernel;	/* Float kernels for the output */
+	bool flushed;				/* Input ended, the tail is pushed */
+};
+
+/* Pick the best kernels for format the CPU we are running on
+ * supports */
+const struct kernel_s *kernel_select(unsigned int format);
+
+/* The n-th best kernels for format the CPU supports, NULL after the
+ * last one (which is scalar) */
+const struct kernel_s *kernel_list(unsigned int format, unsigned int n);
+
+/* Derive the smoothing coefficients from the time constants */
+void agc_init(struct agc_s *agc, unsigned int samplerate);
+
+/* A new soft gain, between two blocks */
+void agc_set_gain(struct agc_s *agc, float soft_gain);
+
+/* Measure one block of up to UNROLL_FACTOR samples and update the
+ * gain without converting, returns the gain the block starts with */
+float agc_update(
+		const struct kernel_s *k,
+		struct agc_s *agc,
+		const void *in,
+		unsigned int n,
+		float *step);
+
+/* Work out which stages are on and set them up */
+int dsp_init(struct dsp_s *dsp, unsigned int samplerate);
+
+void dsp_free(struct dsp_s *dsp);
+
+/* Scale one block with the kernel made for it, one without the gain
+ * ramp if there is none and through the DSP chain if any of it is on */
+static inline void kernel_scale(
+		const struct kernel_s *k,
+		const struct dsp_s *dsp,
+		const void *__restrict__ in,
+		int16_t *__restrict__ out,
+		unsigned int n,
+		float gain,
+		float step,
+		unsigned long long index)
+{
+	bool ramp = step != 0.f;
+
+	if(dsp && dsp->stages)
+		k->scale_dsp[ramp][dsp->stages](in, out, n, gain, step, dsp, index);
+	else if(ramp)
+		k->scale(in, out, n, gain, step);
+	else
+		k->scale_fixed(in, out, n, gain, step);
+}
+
+/* Design the filter for in_rate to out_rate, returns -1 if the
+ * ratio needs too many branches */
+int resampler_init(struct resampler_s *rs, unsigned int in_rate,
+		unsigned int out_rate);
+
+void resampler_free(struct resampler_s *rs);
+
+/* Output samples that can be made from the input so far */
+size_t resampler_ready(const struct resampler_s *rs);
+
+/* Add up to UNROLL_FACTOR input samples, only when nothing is
+ * ready any more */
+void resampler_push(struct resampler_s *rs, const struct kernel_s *k,
+		const void *in, unsigned int n);
+
+/* No more input, let what is in the filter come out */
+void resampler_flush(struct resampler_s *rs);
+
+/* Make up to UNROLL_FACTOR (and no more than ready) output samples,
+ * convert them and update the gain */
+void resample_and_autogain(
+		struct resampler_s *rs,
+		struct agc_s *agc,
+		const struct dsp_s *dsp,
+		unsigned long long index,
+		int16_t *__restrict__ out,
+		unsigned int n);
+
+/* Convert one block of up to UNROLL_FACTOR samples and update
+ * the gain */
+void scale_and_autogain(
+		const struct kernel_s *k,
+		struct agc_s *agc,
+		const struct dsp_s *dsp,
+		unsigned long long index,
+		const void *__restrict__ in,
+		int16_t *__restrict__ out,
+		unsigned int n);
+
+/* Whether every I and Q of n converted samples is within +-level,
+ * gives up at the first louder stretch */
+bool q12_quiet(const int16_t *in, size_t n, int level);
+
+#endif
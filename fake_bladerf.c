@@ -0,0 +1,431 @@
+/* Stand-in for libbladeRF, linked instead of it into bladeout-bench
+ * to measure the pipeline without hardware. Every device consumes
+ * samples at the configured samplerate, from the stream callback
+ * with the given number of transfers in flight or from sync TX, and
+ * reports at close what it got and how often it would have run dry.
+ * With BENCH_UNPACED set in the environment it takes samples as
+ * fast as they come instead, for the pipeline's top speed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libbladeRF.h>
+
+/* Types that changed with the 2.0 API */
+#if LIBBLADERF_API_VERSION >= 0x02000000
+typedef bladerf_sample_rate fake_rate_t;
+typedef bladerf_frequency fake_freq_t;
+typedef bladerf_bandwidth fake_bw_t;
+typedef bladerf_channel fake_channel_t;
+typedef bladerf_channel_layout fake_layout_t;
+typedef bladerf_direction fake_dir_t;
+typedef bladerf_timestamp fake_ts_t;
+typedef const void fake_samples_t;
+#else
+typedef unsigned int fake_rate_t;
+typedef unsigned int fake_freq_t;
+typedef unsigned int fake_bw_t;
+typedef bladerf_module fake_channel_t;
+typedef bladerf_module fake_layout_t;
+typedef bladerf_module fake_dir_t;
+typedef uint64_t fake_ts_t;
+typedef void fake_samples_t;
+#endif
+
+/* The most transfers the stream keeps in flight */
+#define FAKE_MAX_TRANSFERS	256
+
+
+struct bladerf
+{
+	char id[64];
+	unsigned int samplerate;
+	bool unpaced;
+	unsigned long long start;		/* When TX was enabled */
+	unsigned long long end;			/* When everything queued is played */
+	unsigned long long slack;		/* Sync TX: what fits in the queue */
+	unsigned long long samples;		/* Samples consumed */
+	unsigned long long buffers;		/* ...in this many buffers */
+	unsigned long long late;		/* Times the device ran dry */
+	unsigned long long checksum;	/* Keeps the reads from going away */
+};
+
+struct bladerf_stream
+{
+	struct bladerf *dev;
+	bladerf_stream_cb callback;
+	void **buffers;
+	size_t num_buffers;
+	size_t num_samples;
+	size_t num_transfers;
+	void *user_data;
+};
+
+static struct bladerf_devinfo fake_info;
+
+
+static unsigned long long fake_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fake_sleep_until(unsigned long long t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL));
+}
+
+static unsigned long long fake_duration(struct bladerf *dev, size_t n)
+{
+	return (unsigned long long)n * 1000000000ULL / dev->samplerate;
+}
+
+/* Read the buffer like a DMA engine would, it has to come out of
+ * the cache it was converted into */
+static void fake_consume(struct bladerf *dev, const void *samples, size_t n)
+{
+	const uint64_t *p = samples;
+	uint64_t sum = 0;
+	size_t m;
+
+	/* Two SC16 samples per word */
+	for(m = 0; m < n / 2; m++)
+		sum ^= p[m];
+
+	dev->checksum ^= sum;
+	dev->samples += n;
+	dev->buffers++;
+}
+
+/* Queue a buffer behind the ones playing, if they already ran out
+ * the device went dry and starts over with this one */
+static void fake_queue(struct bladerf *dev, size_t n)
+{
+	unsigned long long now;
+
+	if(dev->unpaced)
+		return;
+
+	now = fake_now();
+
+	if(!dev->end)
+		dev->end = now;
+	else if(now > dev->end)
+	{
+		dev->late++;
+		dev->end = now;
+	}
+
+	dev->end += fake_duration(dev, n);
+}
+
+int bladerf_get_device_list(struct bladerf_devinfo **devices)
+{
+	memset(&fake_info, 0, sizeof(fake_info));
+	snprintf(fake_info.serial, sizeof(fake_info.serial), "bench");
+	*devices = &fake_info;
+
+	return 1;
+}
+
+void bladerf_free_device_list(struct bladerf_devinfo *devices)
+{
+	(void)devices;
+}
+
+int bladerf_open(struct bladerf **device, const char *device_identifier)
+{
+	struct bladerf *dev = calloc(1, sizeof(*dev));
+
+	if(!dev)
+		return BLADERF_ERR_MEM;
+
+	snprintf(dev->id, sizeof(dev->id), "%s",
+		device_identifier ? device_identifier : "");
+	dev->samplerate = 1000000;
+	dev->unpaced = getenv("BENCH_UNPACED") != NULL;
+
+	*device = dev;
+
+	return 0;
+}
+
+void bladerf_close(struct bladerf *dev)
+{
+	double dt = dev->start ? (fake_now() - dev->start) * 1e-9 : 0.;
+
+	fprintf(stderr, "bench: device=%s samples=%llu buffers=%llu late=%llu "
+		"time=%.3f msps=%.3f checksum=%llx\n",
+		dev->id[0] ? dev->id : "any",
+		dev->samples,
+		dev->buffers,
+		dev->late,
+		dt,
+		dt > 0. ? dev->samples / dt * 1e-6 : 0.,
+		dev->checksum);
+
+	free(dev);
+}
+
+int bladerf_get_devinfo(struct bladerf *dev, struct bladerf_devinfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	/* Serials are shorter than identifiers */
+	snprintf(info->serial, sizeof(info->serial), "%.*s",
+		(int)sizeof(info->serial) - 1, dev->id[0] ? dev->id : "bench");
+
+	return 0;
+}
+
+int bladerf_set_sample_rate(struct bladerf *dev, fake_channel_t ch,
+		fake_rate_t rate, fake_rate_t *actual)
+{
+	(void)ch;
+
+	if(!rate)
+		return BLADERF_ERR_INVAL;
+
+	dev->samplerate = rate;
+	if(actual)
+		*actual = rate;
+
+	return 0;
+}
+
+int bladerf_set_frequency(struct bladerf *dev, fake_channel_t ch,
+		fake_freq_t frequency)
+{
+	(void)dev;
+	(void)ch;
+	(void)frequency;
+
+	return 0;
+}
+
+int bladerf_set_bandwidth(struct bladerf *dev, fake_channel_t ch,
+		fake_bw_t bandwidth, fake_bw_t *actual)
+{
+	(void)dev;
+	(void)ch;
+
+	if(actual)
+		*actual = bandwidth;
+
+	return 0;
+}
+
+int bladerf_set_txvga1(struct bladerf *dev, int gain)
+{
+	(void)dev;
+	(void)gain;
+
+	return 0;
+}
+
+int bladerf_set_txvga2(struct bladerf *dev, int gain)
+{
+	(void)dev;
+	(void)gain;
+
+	return 0;
+}
+
+int bladerf_enable_module(struct bladerf *dev, fake_channel_t ch, bool enable)
+{
+	(void)ch;
+
+	if(enable && !dev->start)
+		dev->start = fake_now();
+
+	return 0;
+}
+
+int bladerf_init_stream(struct bladerf_stream **stream, struct bladerf *dev,
+		bladerf_stream_cb callback, void ***buffers, size_t num_buffers,
+		bladerf_format format, size_t samples_per_buffer,
+		size_t num_transfers, void *user_data)
+{
+	struct bladerf_stream *s;
+	size_t m;
+
+	(void)format;
+
+	if(num_transfers > FAKE_MAX_TRANSFERS || num_transfers > num_buffers)
+		return BLADERF_ERR_INVAL;
+
+	s = calloc(1, sizeof(*s));
+	if(!s)
+		return BLADERF_ERR_MEM;
+
+	s->dev = dev;
+	s->callback = callback;
+	s->num_buffers = num_buffers;
+	s->num_samples = samples_per_buffer;
+	s->num_transfers = num_transfers;
+	s->user_data = user_data;
+
+	s->buffers = calloc(num_buffers, sizeof(void *));
+	if(!s->buffers)
+		goto error;
+
+	for(m = 0; m < num_buffers; m++)
+	{
+		s->buffers[m] = calloc(samples_per_buffer, 2 * sizeof(int16_t));
+		if(!s->buffers[m])
+			goto error;
+	}
+
+	*stream = s;
+	*buffers = s->buffers;
+
+	return 0;
+
+error:
+	bladerf_deinit_stream(s);
+	return BLADERF_ERR_MEM;
+}
+
+/* Keep num_transfers buffers queued, the oldest one is done once
+ * the device played it */
+int bladerf_stream(struct bladerf_stream *s, fake_layout_t layout)
+{
+	struct bladerf *dev = s->dev;
+	struct bladerf_metadata meta;
+	void *queue[FAKE_MAX_TRANSFERS];
+	size_t head = 0, count = 0;
+	void *p;
+
+	(void)layout;
+
+	memset(&meta, 0, sizeof(meta));
+
+	dev->end = 0;
+
+	while(count < s->num_transfers)
+	{
+		p = s->callback(dev, s, &meta, NULL, s->num_samples, s->user_data);
+		if(p == BLADERF_STREAM_SHUTDOWN)
+			goto drain;
+		if(p == BLADERF_STREAM_NO_DATA)
+			continue;
+
+		fake_queue(dev, s->num_samples);
+		queue[count++] = p;
+	}
+
+	for(;;)
+	{
+		/* The oldest transfer is done when the ones behind it are
+		 * all that's left to play */
+		if(!dev->unpaced && count)
+			fake_sleep_until(dev->end
+				- (count - 1) * fake_duration(dev, s->num_samples));
+
+		if(count)
+		{
+			p = queue[head];
+			head = (head + 1) % s->num_transfers;
+			count--;
+			fake_consume(dev, p, s->num_samples);
+		}
+		else
+			p = NULL;
+
+		p = s->callback(dev, s, &meta, p, s->num_samples, s->user_data);
+		if(p == BLADERF_STREAM_SHUTDOWN)
+			break;
+		if(p == BLADERF_STREAM_NO_DATA)
+			continue;
+
+		fake_queue(dev, s->num_samples);
+		queue[(head + count++) % s->num_transfers] = p;
+	}
+
+drain:
+	while(count)
+	{
+		fake_consume(dev, queue[head], s->num_samples);
+		head = (head + 1) % s->num_transfers;
+		count--;
+	}
+
+	return 0;
+}
+
+void bladerf_deinit_stream(struct bladerf_stream *s)
+{
+	size_t m;
+
+	if(s->buffers)
+		for(m = 0; m < s->num_buffers; m++)
+			free(s->buffers[m]);
+
+	free(s->buffers);
+	free(s);
+}
+
+int bladerf_sync_config(struct bladerf *dev, fake_layout_t layout,
+		bladerf_format format, unsigned int num_buffers,
+		unsigned int buffer_size, unsigned int num_transfers,
+		unsigned int stream_timeout)
+{
+	(void)layout;
+	(void)format;
+	(void)num_transfers;
+	(void)stream_timeout;
+
+	/* All but the buffer being filled are queued ahead */
+	dev->end = 0;
+	dev->slack = num_buffers > 1 ?
+		fake_duration(dev, (size_t)(num_buffers - 1) * buffer_size) : 0;
+
+	return 0;
+}
+
+int bladerf_sync_tx(struct bladerf *dev, fake_samples_t *samples,
+		unsigned int num_samples, struct bladerf_metadata *metadata,
+		unsigned int timeout_ms)
+{
+	(void)metadata;
+	(void)timeout_ms;
+
+	/* Copied out right away, the call returns once it fits in the
+	 * queue */
+	fake_consume(dev, samples, num_samples);
+	fake_queue(dev, num_samples);
+
+	if(!dev->unpaced && dev->end > dev->slack)
+		fake_sleep_until(dev->end - dev->slack);
+
+	return 0;
+}
+
+/* Samples played since TX was enabled */
+int bladerf_get_timestamp(struct bladerf *dev, fake_dir_t dir,
+		fake_ts_t *value)
+{
+	(void)dir;
+
+	*value = dev->start ?
+		(fake_now() - dev->start) * dev->samplerate / 1000000000ULL : 0;
+
+	return 0;
+}
+
+const char *bladerf_strerror(int error)
+{
+	switch(error) {
+		case BLADERF_ERR_MEM: return "Memory allocation error";
+		case BLADERF_ERR_INVAL: return "Invalid operation or parameter";
+		default: return "Unknown error";
+	}
+}
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "convert.h"
+#include "gen.h"
+
+const char *gen_names[GEN_COUNT] = { "none", "tone", "chirp", "noise", "prbs" };
+
+/* Second tap of the usual x^order + x^tap + 1 PRBS polynomials, 0 for
+ * orders we don't know */
+static unsigned int prbs_tap(unsigned int order)
+{
+	switch(order) {
+		case 7: return 6;
+		case 9: return 5;
+		case 11: return 9;
+		case 15: return 14;
+		case 20: return 3;
+		case 23: return 18;
+	}
+
+	return 0;
+}
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b)
+{
+	unsigned long long t;
+
+	while(b)
+	{
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* Whole turns in the shortest period, rounding the frequency if
+ * that is longer than GEN_TONE_PERIOD */
+static size_t tone_period(struct gen_s *g)
+{
+	long long k;
+	unsigned long long l, d;
+
+	if(g->freq == rint(g->freq))
+	{
+		k = llrint(g->freq);
+		l = g->samplerate;
+	}
+	else
+	{
+		l = GEN_TONE_PERIOD;
+		k = llrint(g->freq * l / g->samplerate);
+	}
+
+	d = gcd(llabs(k), l);
+	k /= (long long)d;
+	l /= d;
+
+	if(l > GEN_TONE_PERIOD)
+	{
+		l = GEN_TONE_PERIOD;
+		k = llrint(g->freq * l / g->samplerate);
+		d = gcd(llabs(k), l);
+		k /= (long long)d;
+		l /= d;
+	}
+
+	g->freq = (double)k * g->samplerate / l;
+
+	return l;
+}
+
+int gen_parse(struct gen_s *g, const char *name, unsigned int samplerate,
+		unsigned int channels, float amplitude)
+{
+	const char *spec = name + strlen(GEN_PREFIX), *args;
+	char *end;
+	double ms = 0.;
+	size_t len = 0;
+	unsigned int n;
+
+	memset(g, 0, sizeof(*g));
+
+	if(strncmp(name, GEN_PREFIX, strlen(GEN_PREFIX)))
+		return 0;
+
+	for(n = GEN_NONE + 1; n < GEN_COUNT; n++)
+	{
+		len = strlen(gen_names[n]);
+		if(!strncmp(spec, gen_names[n], len)
+			&& (spec[len] == '\0' || spec[len] == '='))
+			break;
+	}
+
+	if(n == GEN_COUNT)
+	{
+		fprintf(stderr, "Unknown signal \"%s\", it's tone, chirp, noise or "
+			"prbs.\n", spec);
+		return -1;
+	}
+
+	args = spec[len] == '=' ? &spec[len + 1] : "";
+
+	g->kind = n;
+	g->samplerate = samplerate;
+	g->channels = channels;
+	g->bit_len = 1;
+
+	/* Anything louder only clips */
+	g->amplitude = amplitude < 1.f ? amplitude : 1.f;
+
+	switch(g->kind) {
+		case GEN_TONE:
+			g->freq = strtod(args, &end);
+			if(end == args || *end)
+				goto bad;
+			break;
+
+		case GEN_CHIRP:
+			g->freq = strtod(args, &end);
+			if(end == args || *end != ':')
+				goto bad;
+			args = end + 1;
+			g->freq_end = strtod(args, &end);
+			if(end == args || *end != ':')
+				goto bad;
+			args = end + 1;
+			ms = strtod(args, &end);
+			if(end == args || *end || ms <= 0.)
+				goto bad;
+			break;
+
+		case GEN_NOISE:
+			if(*args)
+				goto bad;
+			break;
+
+		case GEN_PRBS:
+			g->order = strtoul(args, &end, 10);
+			if(end != args && *end == ':')
+			{
+				args = end + 1;
+				g->bit_len = strtoul(args, &end, 10);
+			}
+			if(end == args || *end || !g->bit_len || !prbs_tap(g->order))
+				goto bad;
+			break;
+	}
+
+	if(fabs(g->freq) > samplerate / 2. || fabs(g->freq_end) > samplerate / 2.)
+	{
+		fprintf(stderr, "Generated frequencies must be within +-%uHz.\n",
+			samplerate / 2);
+		return -1;
+	}
+
+	switch(g->kind) {
+		case GEN_TONE:
+			g->period = tone_period(g);
+			break;
+
+		case GEN_CHIRP:
+			g->period = (size_t)llrint(ms * samplerate / 1000.);
+			if(!g->period)
+				g->period = 1;
+			break;
+
+		case GEN_PRBS:
+			g->period = (((size_t)1 << g->order) - 1) * g->bit_len;
+			break;
+	}
+
+	if(g->period > GEN_MAX_PERIOD)
+	{
+		fprintf(stderr, "The %s repeats after %zu samples, more than %u "
+			"fit a table.\n", gen_names[g->kind], g->period, GEN_MAX_PERIOD);
+		return -1;
+	}
+
+	/* Enough whole periods for a long copy */
+	if(g->period)
+	{
+		g->table_len = g->period * channels;
+		g->table_len *= (GEN_MIN_TABLE + g->table_len - 1) / g->table_len;
+	}
+
+	return 0;
+
+bad:
+	fprintf(stderr, "Signal is tone=<Hz>, chirp=<from Hz>:<to Hz>:<ms>, "
+		"noise or\nprbs=<order>[:<samples per bit>], orders are 7, 9, 11, "
+		"15, 20 and 23.\n");
+	return -1;
+}
+
+size_t gen_table_size(const struct gen_s *g)
+{
+	return g->table_len * 2 * sizeof(int16_t);
+}
+
+/* Full scale is 1.0 */
+static int16_t gen_q12(const struct gen_s *g, double v)
+{
+	long s = lrint(v * g->amplitude * Q12_SCALE);
+
+	return s > 2047 ? 2047 : s < -2047 ? -2047 : (int16_t)s;
+}
+
+/* One period into the first channel of the table
+ */
+static void gen_period(struct gen_s *g)
+{
+	const unsigned int ch = g->channels;
+	const double rate = g->samplerate;
+	const double sweep = g->period / rate;
+	const unsigned int tap = prbs_tap(g->order);
+	const uint32_t mask = ((uint32_t)1 << g->order) - 1;
+	unsigned long long turns = 0;
+	uint32_t reg = mask, bit = 0;
+	int16_t *out = g->table;
+	double p = 0., t;
+	size_t m;
+
+	if(g->kind == GEN_TONE)
+		turns = (unsigned long long)(llrint(g->freq * g->period / rate)
+			% (long long)g->period + (long long)g->period) % g->period;
+
+	for(m = 0; m < g->period; m++, out += 2 * ch)
+	{
+		switch(g->kind) {
+			case GEN_TONE:
+				/* Exact phase, no accumulated error */
+				p = 2. * M_PI * (double)(turns * m % g->period) / g->period;
+				break;
+
+			case GEN_CHIRP:
+				t = m / rate;
+				p = 2. * M_PI * (g->freq * t
+					+ (g->freq_end - g->freq) * t * t / (2. * sweep));
+				break;
+
+			case GEN_PRBS:
+				if(!(m % g->bit_len))
+				{
+					bit = ((reg >> (g->order - 1)) ^ (reg >> (tap - 1))) & 1;
+					reg = ((reg << 1) | bit) & mask;
+				}
+
+				out[0] = gen_q12(g, bit ? -1. : 1.);
+				out[1] = 0;
+				continue;
+		}
+
+		out[0] = gen_q12(g, cos(p));
+		out[1] = gen_q12(g, sin(p));
+	}
+}
+
+int gen_start(struct gen_s *g)
+{
+	const size_t frame = (size_t)g->channels * 2;
+	size_t m, c;
+
+	g->pos = 0;
+
+	/* Any odd seeds will do, they just must not be 0 */
+	for(c = 0; c < GEN_LANES; c++)
+		g->lanes[c] = 0x9e3779b9u * (uint32_t)(2 * c + 1);
+
+	if(!g->period)
+		return 0;
+
+	g->table = malloc(gen_table_size(g));
+	if(!g->table)
+	{
+		fprintf(stderr, "Error allocating the signal table.\n");
+		return -1;
+	}
+
+	gen_period(g);
+
+	/* The same on every channel */
+	for(m = 0; m < g->period; m++)
+		for(c = 1; c < g->channels; c++)
+			memcpy(&g->table[m * frame + 2 * c], &g->table[m * frame],
+				2 * sizeof(int16_t));
+
+	for(m = g->period * g->channels; m < g->table_len;
+		m += g->period * g->channels)
+		memcpy(&g->table[2 * m], g->table, g->period * frame
+			* sizeof(int16_t));
+
+	return 0;
+}
+
+/* Uniform white noise, I and Q from the halves of one xorshift32 step
+ * per lane. The lanes don't depend on each other, so the inner loop
+ * vectorizes.
+ */
+static void gen_noise(struct gen_s *g, int16_t *__restrict__ out, size_t n)
+{
+	/* Peaks of I and Q together within the amplitude */
+	const int32_t scale = (int32_t)(g->amplitude * Q12_SCALE
+		* (float)M_SQRT1_2);
+	uint32_t s[GEN_LANES], x;
+	unsigned int l;
+	size_t m;
+
+	memcpy(s, g->lanes, sizeof(s));
+
+	for(m = 0; m + GEN_LANES <= n; m += GEN_LANES)
+	{
+		for(l = 0; l < GEN_LANES; l++)
+		{
+			x = s[l];
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			s[l] = x;
+
+			out[2 * (m + l)] = (int16_t)(((int32_t)(int16_t)x * scale) >> 15);
+			out[2 * (m + l) + 1] =
+				(int16_t)(((int32_t)(int16_t)(x >> 16) * scale) >> 15);
+		}
+	}
+
+	for(l = 0; m < n; m++, l++)
+	{
+		x = s[l];
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		s[l] = x;
+
+		out[2 * m] = (int16_t)(((int32_t)(int16_t)x * scale) >> 15);
+		out[2 * m + 1] = (int16_t)(((int32_t)(int16_t)(x >> 16) * scale) >> 15);
+	}
+
+	memcpy(g->lanes, s, sizeof(s));
+}
+
+void gen_fill(struct gen_s *g, int16_t *out, size_t n)
+{
+	size_t len;
+
+	if(!g->table)
+	{
+		gen_noise(g, out, n);
+		return;
+	}
+
+	while(n)
+	{
+		len = g->table_len - g->pos;
+		if(len > n)
+			len = n;
+
+		memcpy(out, &g->table[2 * g->pos], len * 2 * sizeof(int16_t));
+
+		out += 2 * len;
+		n -= len;
+		g->pos += len;
+
+		if(g->pos == g->table_len)
+			g->pos = 0;
+	}
+}
+
+void gen_free(struct gen_s *g)
+{
+	free(g->table);
+	g->table = NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/* Input names that start with this are made up, not read */
+#define GEN_PREFIX			"gen:"
+
+/* Longest period that is worth a table, in samples per channel */
+#define GEN_MAX_PERIOD		(1 << 23)
+
+/* Tones that don't repeat in fewer samples are rounded to one of
+ * this period, a few Hz off at usual rates */
+#define GEN_TONE_PERIOD		(1 << 20)
+
+/* Short periods are repeated in the table up to this, so filling a
+ * slot is a few big copies */
+#define GEN_MIN_TABLE		16384
+
+/* Independent PRNGs for noise, one per vector lane */
+#define GEN_LANES			8
+
+/* Loop mode takes this much noise */
+#define GEN_NOISE_PERIOD	(1 << 20)
+
+/* Signals */
+#define GEN_NONE			0	/* A file or the network */
+#define GEN_TONE			1	/* tone=<Hz> */
+#define GEN_CHIRP			2	/* chirp=<from Hz>:<to Hz>:<ms> */
+#define GEN_NOISE			3	/* noise */
+#define GEN_PRBS			4	/* prbs=<order>[:<samples per bit>] */
+#define GEN_COUNT			5
+
+extern const char *gen_names[GEN_COUNT];
+
+/* Signal generator
+ * Periodic signals are made once into a table of whole periods in
+ * SC16_Q12 and copied out from there, noise comes from GEN_LANES
+ * xorshift generators side by side. Every channel gets the same
+ * periodic signal, and noise of its own.
+ */
+struct gen_s
+{
+	unsigned int kind;			/* GEN_* */
+	double freq;				/* Tone or chirp start in Hz */
+	double freq_end;			/* Chirp end in Hz */
+	unsigned int order;			/* PRBS register length */
+	unsigned int bit_len;		/* ...and samples per bit */
+	float amplitude;			/* Relative to full scale */
+	unsigned int samplerate;
+	unsigned int channels;
+
+	size_t period;				/* Samples per channel until it repeats,
+								 * 0 for noise */
+	int16_t *table;				/* Whole periods, channels interleaved */
+	size_t table_len;			/* ...in samples, all channels */
+	size_t pos;					/* Next sample to go out */
+
+	uint32_t lanes[GEN_LANES];	/* Noise state */
+};
+
+/* Parse an input name, kind is GEN_NONE if it isn't GEN_PREFIX.
+ * Works out the period, nothing is made yet. */
+int gen_parse(struct gen_s *g, const char *name, unsigned int samplerate,
+		unsigned int channels, float amplitude);
+
+/* Bytes of the table gen_start() makes */
+size_t gen_table_size(const struct gen_s *g);
+
+/* Make the table */
+int gen_start(struct gen_s *g);
+
+/* The next n samples (all channels), the signal never ends */
+void gen_fill(struct gen_s *g, int16_t *out, size_t n);
+
+void gen_free(struct gen_s *g);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE				/* CPU affinity */
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -5,9 +6,37 @@
 #include <math.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <libbladeRF.h>
+#include "convert.h"
+#include "stats.h"
+#include "net.h"
+#include "uring.h"
+#include "gen.h"
+
+
+/* TX metadata and timestamps came with libbladeRF 1.2 */
+#if LIBBLADERF_API_VERSION >= 0x01020000
+#define HAVE_TX_META
+#endif
+
+/* Channel layouts and MIMO TX came with libbladeRF 2 */
+#if LIBBLADERF_API_VERSION >= 0x02000000
+#define HAVE_MIMO
+#endif
 
 
 /* Default values */
@@ -22,14 +51,144 @@
 #define DEFAULT_TRANSFERS	(DEFAULT_BUFFERS / 2)
 #define DEFAULT_GAIN		1.f
 #define DEFAULT_AGAIN		0.f
+#define DEFAULT_ATTACK		0.f
+#define DEFAULT_RELEASE		0.f
 #define DEFAULT_DEVICE_ID	""
 #define DEFAULT_FILENAME	"-"
+#define DEFAULT_INPUT		INPUT_STREAM
+#define DEFAULT_FORMAT		FORMAT_CF32
+#define DEFAULT_WORKERS		0
+#define DEFAULT_STATS		0
+#define DEFAULT_UNDERRUN	UNDERRUN_ZERO
+#define DEFAULT_ENGINE		ENGINE_ASYNC
+#define DEFAULT_TX_DELAY	0
+#define DEFAULT_PRIORITY	0
+#define DEFAULT_HUGE		HUGE_NONE
+#define DEFAULT_NUMA_NODE	NUMA_NONE
+#define DEFAULT_WATERMARK	0
+#define DEFAULT_CHANNELS	1
+#define DEFAULT_IN_RATE		0
+#define DEFAULT_FREQ_SHIFT	0
+#define DEFAULT_JITTER		64
+#define DEFAULT_NET_HEADER	NET_HEADER_NONE
+#define DEFAULT_URING_DEPTH	8
+#define DEFAULT_QUIET		0.f
+#define DEFAULT_HANGOVER	100
+#define DEFAULT_BUDGET		0
+
+#define DEFAULT_READ_BLOCKSIZE	65536
+
+/* Upper bound for a single futex sleep, so a shutdown that races
+ * with going to sleep is noticed anyway */
+#define CB_WAIT_TIMEOUT_NS	100000000
+
+/* Stack the main thread touches once before TX, in bytes */
+#define PREFAULT_STACK		(256 * 1024)
+
+/* How long bladerf_sync_tx() may take for one buffer */
+#define SYNC_TIMEOUT_MS		1000
+
+/* A burst after a quiet stretch is scheduled at least this far ahead,
+ * or it starts late */
+#define GATE_LEAD_MS		20
+
+/* How often the stats thread looks for work */
+#define STATS_TICK_NS		100000000
+
+/* ...and the control thread for a stop, in ms */
+#define CONTROL_TICK_MS		100
+
+/* Longest command on the control socket */
+#define CONTROL_LINE		256
+
+/* A latency budget is cut into about this many slots, of a multiple
+ * of BUDGET_ALIGN samples (what libbladeRF takes) and no more than
+ * DEFAULT_SAMPLES */
+#define BUDGET_SLOTS		8
+#define BUDGET_ALIGN		1024
+
+/* The ring depth moves between this and what the budget leaves,
+ * looked at this often. It goes up by half after an underrun, and
+ * down by one after BUDGET_CALM_TICKS without any while callbacks
+ * jitter by less than 1 / BUDGET_JITTER_DIV of a slot. */
+#define BUDGET_MIN_DEPTH	2
+#define BUDGET_TICK_NS		500000000ULL
+#define BUDGET_CALM_TICKS	4
+#define BUDGET_JITTER_DIV	4
+
+/* Input names that start with this are a list of files to play one
+ * after the other */
+#define PLAYLIST_PREFIX		"list:"
+
+/* The start of the next entry the kernel is asked to read ahead while
+ * the current one plays, in bytes */
+#define PLAYLIST_PREFETCH	(4 << 20)
+
+/* Devices fed from one input */
+#define MAX_DEVICES			8
 
-#define DEFAULT_READ_BLOCKSIZE	4096
+/* Input backends */
+#define INPUT_STREAM		0	/* read() into fbuf */
+#define INPUT_MMAP			1	/* Map regular files, convert from there */
+#define INPUT_POPULATE		2	/* Same, but fault the whole file in first */
+#define INPUT_URING			3	/* Reads in flight with io_uring, O_DIRECT */
 
-/* This helps with loop unrolling and auto vectorization
- * The higher you set this, the lower your overhead will be */
-#define UNROLL_FACTOR		8192
+static const char *input_names[] = { "stream", "mmap", "populate", "uring" };
+
+static const char *net_header_names[] = { "none", "seq" };
+
+/* Pages behind the ring */
+#define HUGE_NONE			0	/* Whatever mmap() gives us */
+#define HUGE_THP			1	/* Transparent hugepages, 2MB aligned */
+#define HUGE_2M				2	/* Reserved hugetlbfs pages */
+#define HUGE_1G				3
+
+static const char *huge_names[] = { "none", "thp", "2M", "1G" };
+
+/* Older headers only know the default hugepage size */
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT		26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB		(21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB		(30 << MAP_HUGE_SHIFT)
+#endif
+
+/* -N without a node */
+#define NUMA_NONE			-1	/* Leave it to the kernel */
+#define NUMA_AUTO			-2	/* The node the USB controller is on */
+
+/* What the callback sends when the ring is empty */
+#define UNDERRUN_WAIT		0	/* Nothing, block until the reader catches up */
+#define UNDERRUN_ZERO		1	/* Silence */
+#define UNDERRUN_REPEAT		2	/* The last buffer again (copy mode only) */
+#define UNDERRUN_GATE		3	/* End the burst, TX is off (sync only) */
+
+static const char *underrun_names[] = { "wait", "zero", "repeat", "gate" };
+
+/* Where the memory goes, for the report in usage() */
+#define MEM_RING			0	/* Circular buffer */
+#define MEM_DEVICE			1	/* Device buffers of all devices */
+#define MEM_INPUT			2	/* fbuf, the read staging buffer */
+#define MEM_JOBS			3	/* Input buffers of the workers */
+#define MEM_SYNC			4	/* Sync engine silence and channel splits */
+#define MEM_NET				5	/* UDP jitter buffer */
+#define MEM_URING			6	/* io_uring read ahead */
+#define MEM_GEN				7	/* Periods of a generated signal */
+#define MEM_COUNT			8
+
+static const char *mem_names[] = {
+	"circular buffer", "device buffers", "input buffer", "worker buffers",
+	"sync buffers", "jitter buffer", "read ahead", "signal table"
+};
+
+/* TX engines */
+#define ENGINE_ASYNC		0	/* bladerf_stream() and stream_callback */
+#define ENGINE_SYNC			1	/* bladerf_sync_tx() from the main thread */
+
+static const char *engine_names[] = { "async", "sync" };
 
 /* States */
 #define STATE_RUNNING		0
@@ -38,40 +197,231 @@
 
 
 
+/* One consumer's read position, on a cache line of its own
+ */
+struct cb_pos_s
+{
+	atomic_uint pos;
+} __attribute__((aligned(CACHE_LINE)));
+
 /* Management structure for circular input buffer
+ * Single producer (reader_proc), one consumer (stream_callback) per
+ * device. w and every r run from 0 to 2 * size - 1, the extra bit
+ * tells a full ring (w == r ^ size) from an empty one (w == r).
+ * Each consumer has its own read position, so a slot is referenced
+ * by every consumer that hasn't passed it yet and only returns to
+ * the producer once the one furthest behind did.
+ * A consumer hands out slots at its h, but a slot is only released
+ * when its r passes it. In copy mode both move together, in
+ * zero-copy mode r follows libbladeRF giving the buffers back.
+ * What is set up once comes first, then what only the producer
+ * touches, what it publishes and what the consumers publish, each on
+ * cache lines of their own so the reader's private stores never
+ * invalidate a line a callback is reading.
  */
 struct cb_s
 {
-	unsigned int w;					/* Write position */
-	unsigned int r;					/* Read position */
+	struct cb_pos_s *r;				/* Read positions (consumer owned) */
+	unsigned int num_r;				/* ...one per consumer */
+	void **slots;					/* Slot pointers, into data or sbuf */
 	int16_t *data;					/* Actual buffer */
-	float *fbuf;					/* float buffer for conversion */
 	unsigned int size;				/* Number of elements */
-	unsigned int r_size;			/* Blocksize for fread() */
-	pthread_mutex_t r_lock;			/* For locking changes in r pointer */
-	pthread_mutex_t w_lock;			/* For locking changes in w pointer */
-	pthread_cond_t e_cond;			/* Empty condition */
-	pthread_cond_t f_cond;			/* Full condition */
-	pthread_mutex_t e_cond_lock;
-	pthread_mutex_t f_cond_lock;
+	atomic_uint depth;				/* Slots the reader may fill ahead,
+									 * size unless there is a budget */
+	size_t data_size;				/* Mapped size of data */
+	unsigned int huge;				/* ...and its pages */
+	int numa_node;					/* ...and where they are */
+	unsigned char *quiet;			/* Per slot: nothing above the silence
+									 * level, NULL if not gating */
+	unsigned long long *stamps;		/* Per slot: when its input was in,
+									 * NULL if not tracing */
+
+	void *fbuf						/* Input buffer for conversion */
+		__attribute__((aligned(CACHE_LINE)));
+	size_t f_size;					/* ...its size */
+	size_t f_pos;					/* Start of unconverted input in fbuf */
+	size_t f_len;					/* End of input in fbuf */
+	unsigned int r_size;			/* Blocksize for read() */
+	unsigned int tail;				/* The slowest r when last looked at,
+									 * there is at least that much room */
+
+	atomic_uint w					/* Write position (producer owned) */
+		__attribute__((aligned(CACHE_LINE)));
+	atomic_uint r_waiters;			/* Threads sleeping on a change of r */
+
+	atomic_uint w_waiters			/* Threads sleeping on a change of w */
+		__attribute__((aligned(CACHE_LINE)));
+};
+
+/* One slot worth of input on its way through a worker
+ */
+struct job_s
+{
+	void *raw;					/* Own buffer for read() input */
+	const void *in;				/* The input, in raw or in the map */
+	int16_t *out;				/* Ring slot to convert into */
+	unsigned int slot;			/* ...and its ring position */
+	size_t n;					/* Samples in the slot */
+	unsigned long long index;	/* ...and where they start in the input */
+	float *gain;				/* Per block start gain and step, */
+	float *step;				/* from the AGC lookahead */
+	atomic_uint done;			/* Sequence number + 1 when converted */
+};
+
+/* Conversion worker pool
+ * The reader reads into jobs and runs the AGC over them in order,
+ * the workers only scale. Jobs are taken in sequence and published
+ * in sequence, so w moves just like without workers.
+ */
+struct pool_s
+{
+	unsigned int num_workers;	/* 0 converts in the reader */
+	unsigned int num_jobs;		/* Jobs in flight, power of 2 */
+	unsigned int num_blocks;	/* UNROLL_FACTOR blocks per slot */
+	struct job_s *jobs;
+	pthread_t *threads;
+	unsigned int started;		/* Threads actually running */
+	atomic_uint submitted;		/* Jobs handed over by the reader */
+	atomic_uint taken;			/* Jobs claimed by workers */
+	atomic_uint completed;		/* Jobs published to the ring */
+	atomic_uint submitted_waiters;
+	atomic_uint completed_waiters;
+	pthread_mutex_t publish;	/* Workers only, never the consumer */
+};
+
+/* One file of a playlist
+ */
+struct entry_s
+{
+	char *name;
+	unsigned int format;		/* Its sample format */
+	float gain;					/* ...and soft gain */
+};
+
+/* Files played back to back, the reader goes on with the next one
+ * wherever a slot runs past the end of the current one
+ */
+struct playlist_s
+{
+	struct entry_s *entries;
+	unsigned int num_entries;	/* 0 is no playlist */
+	unsigned int cur;			/* Entry playing now */
+	FILE *next;					/* The one after it, opened ahead */
+	bool gain_held;				/* A control gain replaced the entries' */
 };
 
 /* Buffer management structure
+ * The consumers read the settings at the top and from loop on, the
+ * reader's own state from resampler on is kept off their cache lines,
+ * and so is what the control thread hands over.
  */
 struct buffer_s
 {
-	void **sbuf;				/* Device buffers */
+	unsigned int underrun;		/* Underrun policy */
+	unsigned int engine;		/* TX engine */
+	unsigned int tx_delay;		/* Sync: start bursts this many ms ahead */
+	bool timestamps;			/* Sync: TX with metadata */
+	float quiet;				/* Sync: gate slots below this level, */
+	int quiet_level;			/* ...in Q12 */
+	unsigned int hangover;		/* ...once they went on for this many ms */
+	int16_t *silence;			/* Sync: a slot of zeros */
 	struct cb_s cb;				/* Circular buffers */
-	float gain;					/* Current soft gain */
-	float again;				/* Auto gain setting */
+	bool zero_copy;				/* Ring slots are the device buffers */
+	bool low_memory;			/* ...and as few of them as will do */
+	const struct kernel_s *kernel;	/* Conversion kernels in use */
+	unsigned int format;		/* Input sample format */
+	bool passthrough;			/* Input needs no conversion at all */
+	unsigned int in_rate;		/* Input sample rate, 0 is the device's */
+	bool resample;				/* ...which it isn't */
+	struct resampler_s resampler
+		__attribute__((aligned(CACHE_LINE)));
+	struct dsp_s dsp;			/* DC, IQ and frequency correction */
+	unsigned long long index;	/* Samples converted, for the NCO phase */
+	struct agc_s agc;			/* Soft gain and auto gain control */
+	unsigned int gain_bits;		/* Soft gain the reader applied, as float
+								 * bits */
+	size_t map_pos;				/* Current read offset into map */
+	atomic_uint gain_req		/* ...and the one the control thread
+								 * asks for */
+		__attribute__((aligned(CACHE_LINE)));
+	struct pool_s pool			/* Conversion workers */
+		__attribute__((aligned(CACHE_LINE)));
+	struct stats_s stats;		/* Telemetry counters */
+	struct stats_snap_s stats_start;	/* ...at startup */
+	struct stats_snap_s stats_last;		/* ...at the last report */
+	unsigned int stats_interval;	/* Seconds between reports, 0 is off */
 	FILE *file;					/* Input file handle */
 	char *fname;				/* Input file name */
-	unsigned int pos;			/* Position in device buffers */
+	bool udp;					/* Input comes from the network instead */
+	struct net_s net;
+	struct uring_s uring;		/* Read ahead of the uring backend */
+	unsigned int uring_depth;	/* ...reads in flight */
+	unsigned int input;			/* Input backend */
+	struct gen_s gen;			/* Made up signal instead of any input */
+	struct playlist_s list;		/* Files instead of one input */
+	const char *map;			/* Mapped input file (or NULL) */
+	size_t map_size;
+	bool loop					/* Play a converted image forever */
+		__attribute__((aligned(CACHE_LINE)));
+	bool trace;					/* Measure the latency of every slot */
+	int16_t *image;				/* The image for loop mode */
+	size_t image_len;			/* ...in samples */
+	size_t image_pos;
+	unsigned int channels;		/* Interleaved channels in the input */
 	unsigned int num_buffers;	/* # slots */
-	unsigned int num_samples;	/* Samples per slot */
+	unsigned int num_samples;	/* Samples per slot, all channels */
 	unsigned int num_transfers;	/* Maximum concurrent transfers */
+	unsigned int watermark;		/* Start TX at this fill, 0 is full */
+	bool watermark_ms;			/* ...which is in ms, not slots */
+	unsigned int budget;		/* Latency budget in ms, 0 is none */
+	unsigned int depth_min;		/* ...the ring depth stays within */
+	unsigned int depth_max;
+	unsigned long long slot_ns;	/* ...and how long a slot takes */
+};
+
+/* Scheduling and memory set up for the threads on the TX path
+ * The CPU list is handed out in order: the streaming thread (main),
+ * the reader, the workers, then the streaming threads of all other
+ * devices, wrapping around if it's too short.
+ */
+struct rt_s
+{
+	int priority;					/* SCHED_FIFO for the streaming thread,
+									 * one less for the rest, 0 is off */
+	int *cpus;						/* CPUs to pin to */
+	unsigned int num_cpus;			/* ...number of them, 0 is anywhere */
+	bool lock;						/* mlockall() and prefault */
+};
+
+/* What the budget step saw last time
+ */
+struct budget_s
+{
+	unsigned long long next;		/* When to look again */
+	unsigned long long underruns;
+	unsigned long long cb_jitter_ns;
+	unsigned long long cb_count;
+	unsigned int calm;				/* Looks in a row without underruns */
+};
+
+/* The control socket and what it controls
+ */
+struct control_s
+{
+	char *path;						/* UNIX socket, NULL is none */
+	int fd;							/* Listening */
+	int client;						/* The one connection, -1 is none */
+	char line[CONTROL_LINE];		/* Partial command */
+	size_t len;
+	struct devinfo_s *devices;
+	unsigned int num_devices;
+	struct buffer_s *buf;
 };
 
+#define RT_STREAM			0		/* Index of the threads in the CPU list */
+#define RT_READER			1
+#define RT_WORKER			2
+
 /* All the device parameters and the device itself
  */
 struct devinfo_s
@@ -84,59 +434,397 @@ struct devinfo_s
 	unsigned int frequency;
 	int txvga1;						/* TXVGA1 gain in dB */
 	int txvga2;						/* TXVGA2 gain in dB */
-	struct buffer_s buffers;		/* Buffer management */
+	struct buffer_s *buffers;		/* Buffer management, shared */
+	unsigned int index;				/* Our read position in the ring */
+	int channel;					/* Input channel we send, -1 is all */
+	bool mimo;						/* ...which go to two TX channels */
+	unsigned int num_samples;		/* Samples per device buffer */
+	void **sbuf;					/* Device buffers */
+	void **spare;					/* Zero-copy: silence for underruns */
+	unsigned int spare_pos;
+	unsigned int pos;				/* Position in device buffers */
+	unsigned int h;					/* Handout position in the ring */
+	int16_t *split;					/* Sync: our channel of a slot */
+	unsigned int quiet_run;			/* Sync: quiet slots in a row */
+	bool gap;						/* ...some of them weren't sent */
+	uint64_t ts;					/* ...timestamp of the next sample */
+	bool air_known;					/* Sync: the burst has a timestamp, */
+	unsigned long long air_t;		/* ...and the device clock was */
+	uint64_t air_ts;				/* ...at this timestamp then */
+	struct stats_clock_s clock;		/* Callback timing */
+	pthread_t thread;				/* Streaming thread, but the first */
+	bool thread_started;
 };
 
 /* Just this one state */
-static int state = STATE_RUNNING;
+static volatile int state = STATE_RUNNING;
+
+/* Set by SIGUSR1 */
+static volatile sig_atomic_t report_now = 0;
+
+/* Two jobs per worker keep everybody busy while the reader
+ * fills the next ones
+ */
+static unsigned int pool_num_jobs(unsigned int num_workers)
+{
+	unsigned int n;
+
+	for(n = 1; n < 2 * num_workers;)
+		n <<= 1;
+
+	return n;
+}
+
+/* Bytes per sample of the input, the largest of all playlist
+ * entries */
+static unsigned int input_size(const struct buffer_s *buf)
+{
+	unsigned int size = formats[buf->format].size, n;
+
+	for(n = 0; n < buf->list.num_entries; n++)
+		if(formats[buf->list.entries[n].format].size > size)
+			size = formats[buf->list.entries[n].format].size;
+
+	return size;
+}
+
+/* Bytes of every buffer the configuration allocates, from before the
+ * slots are widened to all channels. Bookkeeping of a few kB and the
+ * loop image, which is as big as the input, aren't counted.
+ */
+static size_t memory_use(const struct buffer_s *buf,
+		unsigned int num_devices, size_t *parts)
+{
+	const struct cb_s *cb = &buf->cb;
+	const size_t sample = 2 * sizeof(int16_t);
+	const size_t slot = (size_t)buf->num_samples * buf->channels * sample;
+	const size_t dev_slot = buf->channels > 1 && num_devices > 1 ?
+		(size_t)buf->num_samples * sample : slot;
+	const unsigned int workers = buf->loop || buf->resample
+		|| buf->gen.kind || buf->list.num_entries ?
+			0 : buf->pool.num_workers;
+	size_t page, total = 0;
+	unsigned int n;
+
+	for(n = 0; n < MEM_COUNT; n++)
+		parts[n] = 0;
+
+	/* Rounded up the way ring_alloc() maps it */
+	if(!buf->zero_copy && !buf->loop)
+	{
+		page = cb->huge == HUGE_1G ? 1UL << 30 : cb->huge != HUGE_NONE ?
+			2UL << 20 : (size_t)sysconf(_SC_PAGESIZE);
+		parts[MEM_RING] = (cb->size * slot + page - 1) / page * page;
+	}
+
+	/* The sync engine's are libbladeRF's, but they're there all the
+	 * same */
+	parts[MEM_DEVICE] = (size_t)num_devices * dev_slot
+		* (buf->engine == ENGINE_SYNC || !buf->zero_copy ?
+			buf->num_buffers : cb->size + buf->num_transfers);
+
+	if(buf->input != INPUT_MMAP && buf->input != INPUT_POPULATE
+		&& !buf->passthrough && !workers)
+		parts[MEM_INPUT] = (size_t)UNROLL_FACTOR * input_size(buf)
+			+ cb->r_size;
+
+	if(workers)
+		parts[MEM_JOBS] = (size_t)pool_num_jobs(workers) * buf->num_samples
+			* buf->channels * formats[buf->format].size;
+
+	if(buf->engine == ENGINE_SYNC)
+		parts[MEM_SYNC] = slot + (dev_slot != slot ?
+			num_devices * dev_slot : 0);
+
+	if(net_kind(buf->fname) == NET_UDP)
+		parts[MEM_NET] = ((size_t)buf->net.depth + NET_BATCH)
+			* NET_MAX_PACKET;
+
+	if(buf->input == INPUT_URING && !buf->loop)
+		parts[MEM_URING] = (size_t)buf->uring_depth
+			* ((cb->r_size + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN);
+
+	parts[MEM_GEN] = gen_table_size(&buf->gen);
+
+	for(n = 0; n < MEM_COUNT; n++)
+		total += parts[n];
+
+	return total;
+}
+
+/* Size slots, transfers and the ring to the latency budget, the
+ * transfers in flight take their share first
+ */
+static int budget_size(struct buffer_s *buf, unsigned int samplerate)
+{
+	struct cb_s *cb = &buf->cb;
+	const unsigned long long total = (unsigned long long)buf->budget
+		* samplerate / 1000;
+	unsigned int slots;
+
+	buf->num_samples = total / BUDGET_SLOTS / BUDGET_ALIGN * BUDGET_ALIGN;
+	if(buf->num_samples < BUDGET_ALIGN)
+		buf->num_samples = BUDGET_ALIGN;
+	if(buf->num_samples > DEFAULT_SAMPLES)
+		buf->num_samples = DEFAULT_SAMPLES;
+
+	slots = total / buf->num_samples;
+
+	/* Two transfers keep the USB busy, more only make it safer */
+	buf->num_transfers = slots / 4;
+	if(buf->num_transfers < 2)
+		buf->num_transfers = 2;
+	if(buf->num_transfers > DEFAULT_TRANSFERS)
+		buf->num_transfers = DEFAULT_TRANSFERS;
+	buf->num_buffers = 2 * buf->num_transfers;
+
+	if(slots < buf->num_transfers + BUDGET_MIN_DEPTH)
+	{
+		fprintf(stderr, "A latency budget of %ums holds less than %u slots "
+			"of %u samples.\n", buf->budget,
+			buf->num_transfers + BUDGET_MIN_DEPTH, buf->num_samples);
+		return -1;
+	}
+
+	/* In zero-copy mode the transfers hold ring slots */
+	buf->depth_min = BUDGET_MIN_DEPTH
+		+ (buf->zero_copy ? buf->num_transfers : 0);
+	buf->depth_max = buf->zero_copy ? slots : slots - buf->num_transfers;
+
+	for(cb->size = 2; cb->size < buf->depth_max; cb->size <<= 1);
+
+	/* Reading ahead of a slot only holds up its first samples */
+	if(cb->r_size > buf->num_samples * formats[buf->format].size)
+		cb->r_size = buf->num_samples * formats[buf->format].size;
+
+	buf->slot_ns = (unsigned long long)buf->num_samples * 1000000000ULL
+		/ samplerate;
+
+	fprintf(stderr, "Latency budget of %ums: slots of %u samples (%.2fms), "
+		"%u transfers, up to %u of %u ring slots in use.\n", buf->budget,
+		buf->num_samples, buf->slot_ns * 1e-6, buf->num_transfers,
+		buf->depth_max, cb->size);
+
+	return 0;
+}
+
+/* Deepen the ring after an underrun, make it shallower once things
+ * have been calm for a while and the callbacks keep good time
+ */
+static void budget_step(struct buffer_s *buf, struct budget_s *b,
+		unsigned long long now)
+{
+	struct cb_s *cb = &buf->cb;
+	unsigned int depth = atomic_load_explicit(&cb->depth,
+		memory_order_relaxed), was = depth;
+	unsigned long long underruns, jitter, count;
+
+	b->next = now + BUDGET_TICK_NS;
+
+	underruns = atomic_load_explicit(&buf->stats.underruns,
+		memory_order_relaxed);
+	jitter = atomic_load_explicit(&buf->stats.cb_jitter_ns,
+		memory_order_relaxed);
+	count = atomic_load_explicit(&buf->stats.cb_count, memory_order_relaxed);
+
+	if(underruns != b->underruns)
+	{
+		depth += depth / 2 > 1 ? depth / 2 : 1;
+		if(depth > buf->depth_max)
+			depth = buf->depth_max;
+	}
+	else if(++b->calm < BUDGET_CALM_TICKS)
+		return;
+	else if(count > b->cb_count && depth > buf->depth_min
+		&& (jitter - b->cb_jitter_ns) / (count - b->cb_count)
+			* BUDGET_JITTER_DIV < buf->slot_ns)
+		depth--;
+
+	b->calm = 0;
+	b->underruns = underruns;
+	b->cb_jitter_ns = jitter;
+	b->cb_count = count;
+
+	if(depth == was)
+		return;
+
+	atomic_store_explicit(&cb->depth, depth, memory_order_relaxed);
+	fprintf(stderr, "Ring depth now %u slots (%.1fms).\n", depth,
+		depth * (buf->slot_ns * 1e-6));
+}
 
 /* Display usage information
  */
-static void usage(char *name, struct devinfo_s *dev)
+static void usage(char *name, struct devinfo_s *dev, const struct rt_s *rt,
+		unsigned int num_devices)
 {
+	size_t parts[MEM_COUNT], total;
+	unsigned int n;
+
 	fprintf(stderr, "%s <options>\n"
 		"\t-h\t\tShow this help text.\n"
-		"\t-d <device_id>\tDevice string (current: \"%s\").\n"
+		"\t-d <device_id>\tDevice string, repeat it to feed more devices\n"
+		"\t\t\tfrom the same input (current: \"%s\").\n"
 		"\t-i <file>\tInput filename (current: \"%s\").\n"
+		"\t\t\tudp://host:port and tcp://host:port read from the\n"
+		"\t\t\tnetwork, without a host UDP takes whatever comes\n"
+		"\t\t\tto the port and TCP waits for a connection.\n"
+		"\t\t\tgen:tone=<Hz>, gen:chirp=<from Hz>:<to Hz>:<ms>,\n"
+		"\t\t\tgen:noise and gen:prbs=<order>[:<samples per bit>]\n"
+		"\t\t\tmake a test signal instead, -m is its amplitude.\n"
+		"\t\t\tlist:<file> plays the files listed in it back to\n"
+		"\t\t\tback, each line a file name and optionally its\n"
+		"\t\t\tformat and soft gain, -F and -m otherwise.\n"
+		"\t-I <backend>\tInput backend, stream, mmap, populate or uring,\n"
+		"\t\t\tthe latter three for regular files only\n"
+		"\t\t\t(current: %s).\n"
+		"\t-q <reads>\tReads in flight for the uring backend, of -R\n"
+		"\t\t\tbytes each (current: %u).\n"
+		"\t-j <packets>\tUDP jitter buffer length, missing packets go\n"
+		"\t\t\tout as silence once it moved past them\n"
+		"\t\t\t(current: %u).\n"
+		"\t-U <header>\tUDP packet header, none or seq for a 64 bit\n"
+		"\t\t\tlittle endian sequence number (current: %s).\n"
+		"\t-F <format>\tInput format, cf32, cs16, cs8, cu8 or q12\n"
+		"\t\t\t(current: %s).\n"
+		"\t-C <channels>\tInterleaved channels in the input, 2 go to\n"
+		"\t\t\tboth TX channels of a bladeRF 2.0 or are split\n"
+		"\t\t\tover the devices (current: %u).\n"
 		"\t-f <frequency>\tFrequency (current: %uHz).\n"
 		"\t-r <rate>\tSamplerate (current: %u).\n"
+		"\t-x <rate>\tSamplerate of the input, resampled to the one\n"
+		"\t\t\tabove, 0 is the same (current: %u).\n"
+		"\t-o <offset>\tShift the input by this many Hz (current: %i).\n"
+		"\t-O <i,q>\tRemove a DC offset, relative to full scale\n"
+		"\t\t\t(current: %g,%g).\n"
+		"\t-B <gain,phase>\tPre-correct the IQ imbalance of the TX path,\n"
+		"\t\t\tQ gain relative to I and phase error in degrees\n"
+		"\t\t\t(current: %g,%g).\n"
 		"\t-b <bandwidth>\tLPF bandwidth (current: %uHz).\n"
 		"\t-g <txvga1>\tGain for txvga1 (current: %idB).\n"
 		"\t-G <txvga2>\tGain for txvga2 (current: %idB).\n"
 		"\t-m <gain>\tSoft gain (current: %f).\n"
 		"\t-a <autogain>\tAuto gain adjustment (current: %f).\n"
+		"\t-A <attack>\tAuto gain attack time (current: %.1fms).\n"
+		"\t-D <release>\tAuto gain release time, 0 holds the gain\n"
+		"\t\t\t(current: %.1fms).\n"
+		"\t-M <detector>\tAuto gain detector, peak or rms (current: %s).\n"
 		"\t-p <prebuffer>\tCircular buffer size (current: %u).\n"
+		"\t-y <ms>\t\tLatency budget, sizes -s, -p, -n and -t to it\n"
+		"\t\t\t(none of them can be given then), caps -R and\n"
+		"\t\t\tkeeps the ring only as deep as underruns and\n"
+		"\t\t\tjitter need, 0 is off (current: %u).\n"
+		"\t-W <slots>\tStart TX once this many slots are filled, with\n"
+		"\t\t\tan ms suffix it's time, 0 waits for a full\n"
+		"\t\t\tbuffer (current: %u%s).\n"
 		"\t-n <buffers>\tNumber of device buffers (current: %u).\n"
 		"\t-s <samples>\tSamples per buffer (current: %u).\n"
 		"\t-t <transfers>\tMaximum concurrent transfers (current: %u).\n"
-		"\t-R <blocksize>\tBlocksize for read operations (current: %u).\n"
-		"\n",
+		"\t-u <policy>\tOn underrun send zero, repeat the last buffer,\n"
+		"\t\t\twait for input or gate TX off until it is back\n"
+		"\t\t\t(sync engine only) (current: %s).\n"
+		"\t-E <engine>\tTX engine, async or sync (current: %s).\n"
+		"\t-Y <delay>\tSync engine: schedule every burst this many ms\n"
+		"\t\t\tahead of the device clock, 0 sends right away\n"
+		"\t\t\t(current: %u).\n"
+		"\t-Q <level>\tSync engine: gate TX off while every sample of a\n"
+		"\t\t\tslot is below this fraction of full scale, the\n"
+		"\t\t\ttime in between is kept, 0 is off (current: %f).\n"
+		"\t-T <hangover>\tGate only after this many ms below the level\n"
+		"\t\t\t(current: %u).\n",
 		name,
 		dev->device_id,
-		dev->buffers.fname,
+		dev->buffers->fname,
+		input_names[dev->buffers->input],
+		dev->buffers->uring_depth,
+		dev->buffers->net.depth,
+		net_header_names[dev->buffers->net.header],
+		formats[dev->buffers->format].name,
+		dev->buffers->channels,
 		dev->frequency,
 		dev->samplerate,
+		dev->buffers->in_rate,
+		dev->buffers->dsp.freq,
+		dev->buffers->dsp.dc_i,
+		dev->buffers->dsp.dc_q,
+		dev->buffers->dsp.iq_gain,
+		dev->buffers->dsp.iq_phase,
 		dev->bandwidth,
 		dev->txvga1,
 		dev->txvga2,
-		dev->buffers.gain,
-		dev->buffers.again,
-		dev->buffers.cb.size,
-		dev->buffers.num_buffers,
-		dev->buffers.num_samples,
-		dev->buffers.num_transfers,
-		dev->buffers.cb.r_size
+		dev->buffers->agc.soft_gain,
+		dev->buffers->agc.target,
+		dev->buffers->agc.attack,
+		dev->buffers->agc.release,
+		dev->buffers->agc.rms ? "rms" : "peak",
+		dev->buffers->cb.size,
+		dev->buffers->budget,
+		dev->buffers->watermark,
+		dev->buffers->watermark_ms ? "ms" : "",
+		dev->buffers->num_buffers,
+		dev->buffers->num_samples,
+		dev->buffers->num_transfers,
+		underrun_names[dev->buffers->underrun],
+		engine_names[dev->buffers->engine],
+		dev->buffers->tx_delay,
+		dev->buffers->quiet,
+		dev->buffers->hangover
 	);
 
-	fprintf(stderr, "Circular buffer size: %lukB.\n"
-		"Device buffer size: %lukB.\n"
-		"Float buffer size: %lukB.\n",
-		(dev->buffers.cb.size * dev->buffers.num_samples * 2
-			* sizeof(int16_t)) >> 10,
-		(dev->buffers.num_buffers * dev->buffers.num_samples * 2
-			* sizeof(int16_t)) >> 10,
-		(dev->buffers.num_samples * sizeof(float) * 2) >> 10
+	/* Too long for one format string */
+	fprintf(stderr,
+		"\t-R <blocksize>\tBlocksize for read operations (current: %u).\n"
+		"\t-w <workers>\tConversion worker threads, 0 converts in the\n"
+		"\t\t\treader (current: %u).\n"
+		"\t-S <seconds>\tPrint a stats line every so often, SIGUSR1\n"
+		"\t\t\tprints one any time (current: %u).\n"
+		"\t-P <priority>\tSCHED_FIFO priority of the streaming thread,\n"
+		"\t\t\treader and workers get one less, 0 is off\n"
+		"\t\t\t(current: %i).\n"
+		"\t-c <cpus>\tComma separated CPUs for the streaming thread,\n"
+		"\t\t\tthe reader, the workers and the streaming threads\n"
+		"\t\t\tof further devices, in that order.\n"
+		"\t-X <socket>\tUNIX socket for commands while streaming, one\n"
+		"\t\t\tper line: freq <Hz>, txvga1 <dB> and txvga2 <dB>\n"
+		"\t\t\twith an optional device number, gain <soft gain>\n"
+		"\t\t\t(which also replaces the gains of the playlist\n"
+		"\t\t\tentries still to come).\n"
+		"\t-k\t\tLock all memory and fault it in before TX starts\n"
+		"\t\t\t(current: %s).\n"
+		"\t-H <pages>\tCircular buffer pages, none, thp, 2M or 1G\n"
+		"\t\t\t(current: %s).\n"
+		"\t-N <node>\tNUMA node for the circular buffer, or auto for\n"
+		"\t\t\tthe one the device is attached to.\n"
+		"\t-z\t\tZero-copy, use the device buffers as circular buffer\n"
+		"\t\t\t(-n is ignored then) (current: %s).\n"
+		"\t-L\t\tLow memory, zero-copy with a circular buffer just\n"
+		"\t\t\tbigger than -t, no workers and reads of one\n"
+		"\t\t\tblock (current: %s).\n"
+		"\t-l\t\tConvert the whole input once, then play it in a\n"
+		"\t\t\tloop (current: %s).\n"
+		"\t-e\t\tTrace how long every slot takes from its input to\n"
+		"\t\t\tlibbladeRF and to the air (current: %s).\n"
+		"\n",
+		dev->buffers->cb.r_size,
+		dev->buffers->pool.num_workers,
+		dev->buffers->stats_interval,
+		rt->priority,
+		rt->lock ? "on" : "off",
+		huge_names[dev->buffers->cb.huge],
+		dev->buffers->zero_copy ? "on" : "off",
+		dev->buffers->low_memory ? "on" : "off",
+		dev->buffers->loop ? "on" : "off",
+		dev->buffers->trace ? "on" : "off"
 	);
+
+	total = memory_use(dev->buffers, num_devices, parts);
+
+	fprintf(stderr, "Memory for this configuration, in bytes:\n");
+	for(n = 0; n < MEM_COUNT; n++)
+		if(parts[n])
+			fprintf(stderr, "\t%-16s%12zu\n", mem_names[n], parts[n]);
+	fprintf(stderr, "\t%-16s%12zu%s\n", "total", total,
+		dev->buffers->loop ? ", plus the converted input" : "");
 }
 
 /* Signal handler
@@ -144,16 +832,232 @@ static void usage(char *name, struct devinfo_s *dev)
 static void sighandler(int signum)
 {
 	switch(signum) {
+		case SIGUSR1:
+			report_now = 1;
+			break;
 		default:
 			fprintf(stderr, "Signal %d caught, exiting.\n", signum);
 			state |= STATE_EXIT;
 	}
 }
 
+/* Wake up everybody sleeping on an index
+ */
+static void cb_futex_wake(atomic_uint *idx)
+{
+	syscall(SYS_futex, idx, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleep until *idx differs from old (or we are told to stop).
+ * The waiter count is raised before the index is checked again,
+ * so a concurrent cb_wake() can't slip through unnoticed.
+ */
+static void cb_wait(atomic_uint *idx, atomic_uint *waiters, unsigned int old)
+{
+	const struct timespec timeout = { 0, CB_WAIT_TIMEOUT_NS };
+
+	atomic_fetch_add(waiters, 1);
+
+	while(!state && atomic_load(idx) == old)
+		syscall(SYS_futex, idx, FUTEX_WAIT_PRIVATE, old, &timeout, NULL, 0);
+
+	atomic_fetch_sub(waiters, 1);
+}
+
+/* Publish a new index value and wake the other side, but only
+ * enter the kernel if somebody is actually sleeping
+ */
+static void cb_publish(atomic_uint *idx, atomic_uint *waiters,
+		unsigned int val)
+{
+	atomic_store_explicit(idx, val, memory_order_release);
+
+	/* Pairs with the fetch_add in cb_wait() */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if(atomic_load_explicit(waiters, memory_order_relaxed))
+		cb_futex_wake(idx);
+}
+
+/* The read position furthest behind w, the one that decides if the
+ * ring is full. which tells whose it is, so it can be waited on.
+ */
+static unsigned int cb_tail(struct cb_s *cb, unsigned int w,
+		unsigned int *which)
+{
+	unsigned int n, r, used, tail = 0, most = 0;
+
+	*which = 0;
+
+	for(n = 0; n < cb->num_r; n++)
+	{
+		r = atomic_load_explicit(&cb->r[n].pos, memory_order_acquire);
+		used = (w - r) & (2 * cb->size - 1);
+
+		if(!n || used > most)
+		{
+			most = used;
+			tail = r;
+			*which = n;
+		}
+	}
+
+	return tail;
+}
+
+/* Wait until the slowest consumer is done with the slot at w, the
+ * reader counts how often and how long it had to
+ */
+static void cb_wait_room(struct buffer_s *buf, unsigned int w)
+{
+	struct cb_s *cb = &buf->cb;
+	unsigned int k, r = cb->tail;
+	unsigned int depth = atomic_load_explicit(&cb->depth,
+		memory_order_relaxed);
+	unsigned long long t;
+
+	/* The consumers' lines are only read when what we saw of them
+	 * last time isn't enough */
+	if(state || ((w - r) & (2 * cb->size - 1)) < depth)
+		return;
+
+	r = cb_tail(cb, w, &k);
+	cb->tail = r;
+
+	if(((w - r) & (2 * cb->size - 1)) < depth)
+		return;
+
+	t = stats_now();
+	stats_add(&buf->stats.full_waits, 1);
+
+	/* A budget step lowering the depth just holds us back longer */
+	do {
+		cb_wait(&cb->r[k].pos, &cb->r_waiters, r);
+		r = cb_tail(cb, w, &k);
+		depth = atomic_load_explicit(&cb->depth, memory_order_relaxed);
+	} while(!state && ((w - r) & (2 * cb->size - 1)) >= depth);
+
+	cb->tail = r;
+
+	stats_add(&buf->stats.full_ns, stats_now() - t);
+}
+
+/* Copy from the loop image, wrapping around exactly at its end
+ */
+static void loop_fill(struct buffer_s *buf, int16_t *out, size_t n)
+{
+	while(n)
+	{
+		size_t len = buf->image_len - buf->image_pos;
+
+		if(len > n)
+			len = n;
+
+		memcpy(out, &buf->image[2 * buf->image_pos],
+			len * 2 * sizeof(int16_t));
+
+		out += 2 * len;
+		n -= len;
+		buf->image_pos += len;
+
+		if(buf->image_pos == buf->image_len)
+			buf->image_pos = 0;
+	}
+}
+
+/* A filled slot's input is in, before it's published
+ */
+static void trace_read(struct buffer_s *buf, unsigned int idx)
+{
+	struct cb_s *cb = &buf->cb;
+
+	if(cb->stamps)
+		cb->stamps[idx & (cb->size - 1)] = stats_now();
+}
+
+/* A slot goes to libbladeRF now, its first sample is on the air at
+ * timestamp ts if the burst has one. Otherwise that's after the
+ * transfers ahead of it.
+ */
+static void trace_slot(struct devinfo_s *device, unsigned int idx,
+		uint64_t ts)
+{
+	struct buffer_s *buf = device->buffers;
+	struct cb_s *cb = &buf->cb;
+	unsigned long long now, in, air;
+
+	if(!cb->stamps)
+		return;
+
+	now = stats_now();
+	in = cb->stamps[idx & (cb->size - 1)];
+
+	if(device->air_known)
+		air = device->air_t + (ts - device->air_ts) * 1000000000ULL
+			/ device->samplerate;
+	else
+		air = now + (unsigned long long)(buf->num_transfers - 1)
+			* device->num_samples * 1000000000ULL / device->samplerate;
+
+	/* Late for its timestamp, it's out as soon as it can be */
+	if(air < now)
+		air = now;
+
+	stats_latency(&buf->stats.handoff, now - in);
+	stats_latency(&buf->stats.air, air - in);
+}
+
+/* Take one channel out of a slot of interleaved ones
+ */
+static void split_channel(const struct devinfo_s *device,
+		const int16_t *__restrict__ in, int16_t *__restrict__ out)
+{
+	const unsigned int channels = device->buffers->channels;
+	size_t m;
+
+	in += 2 * device->channel;
+
+	/* One I/Q pair at a time, that's a 32 bit move */
+	for(m = 0; m < device->num_samples; m++)
+		memcpy(&out[2 * m], &in[2 * m * channels], 2 * sizeof(int16_t));
+}
+
+/* Something to send while the ring is empty, right away
+ */
+static void *underrun_fill(struct devinfo_s *device)
+{
+	struct buffer_s *buf = device->buffers;
+	const size_t len = (size_t)device->num_samples * 2 * sizeof(int16_t);
+	void *ptr;
+
+	/* One spare per transfer, so none is ever in flight twice.
+	 * They are zero from the start and stay that way. */
+	if(buf->zero_copy)
+	{
+		ptr = device->spare[device->spare_pos];
+		device->spare_pos = (device->spare_pos + 1) % buf->num_transfers;
+
+		return ptr;
+	}
+
+	ptr = device->sbuf[device->pos];
+
+	/* The previous buffer is still in flight, but only read from */
+	if(buf->underrun == UNDERRUN_REPEAT)
+		memcpy(ptr, device->sbuf[(device->pos + buf->num_buffers - 1)
+			% buf->num_buffers], len);
+	else
+		memset(ptr, 0, len);
+
+	device->pos = (device->pos + 1) % buf->num_buffers;
+
+	return ptr;
+}
+
 /* This gets called when the bladeRF needs more data
  */
 static void *stream_callback(
-		struct bladerf *device,
+		struct bladerf *dev,
 		struct bladerf_stream *stream,
 		struct bladerf_metadata *metadata,
 		void *samples,
@@ -161,9 +1065,11 @@ static void *stream_callback(
 		void *user_data)
 {
 	int16_t *rptr, *wptr;
-	struct buffer_s *buf = (struct buffer_s *)(user_data);
+	struct devinfo_s *device = (struct devinfo_s *)(user_data);
+	struct buffer_s *buf = device->buffers;
 	struct cb_s *cb = &buf->cb;
-	unsigned int tmp_w;
+	atomic_uint *r = &cb->r[device->index].pos;
+	unsigned int tmp_w, tmp_r, tmp_h;
 
 	/* User wants to stop NOW */
 	if(state & STATE_EXIT)
@@ -171,292 +1077,3064 @@ static void *stream_callback(
 		wptr = NULL;
 		goto out;
 	}
+
+	stats_callback(&buf->stats, &device->clock);
+
+	/* Loop mode has no reader and no ring */
+	if(buf->loop)
+	{
+		wptr = (int16_t *)device->sbuf[device->pos];
+		device->pos = (device->pos + 1) % buf->num_buffers;
+
+		loop_fill(buf, wptr, device->num_samples);
+		goto out;
+	}
 	
-	/* Get write pointer for comparison in a safe way */
-	pthread_mutex_lock(&cb->w_lock);
-	tmp_w = cb->w;
-	pthread_mutex_unlock(&cb->w_lock);
+	/* Our own pointers need no ordering, the producer's one is
+	 * acquired so the slot contents are visible to us */
+	tmp_r = atomic_load_explicit(r, memory_order_relaxed);
+	tmp_h = device->h;
 
-	/* Check if empty */
-	if(tmp_w == cb->r)
+	/* A transfer came back, so libbladeRF is done with the oldest
+	 * slot it got from us. Transfers complete in order. */
+	if(buf->zero_copy && samples && tmp_r != tmp_h
+		&& samples == cb->slots[tmp_r & (cb->size - 1)])
+	{
+		tmp_r = (tmp_r + 1) & (2 * cb->size - 1);
+		cb_publish(r, &cb->r_waiters, tmp_r);
+	}
+
+	tmp_w = atomic_load_explicit(&cb->w, memory_order_acquire);
+
+	stats_fill(&buf->stats, (tmp_w - tmp_h) & (2 * cb->size - 1));
+
+	/* Check if empty, the stats thread tells the user */
+	if(tmp_w == tmp_h)
+	{
+		/* At the end of the input that's no underrun */
+		if(state)
+		{
+			wptr = NULL;
+			goto out;
+		}
+
+		stats_add_shared(&buf->stats.underruns, 1);
+
+		/* Don't hold up the transfers in flight, send something
+		 * and look at the ring again next time */
+		if(buf->underrun != UNDERRUN_WAIT)
+		{
+			wptr = underrun_fill(device);
+			goto out;
+		}
+	}
+
+	while(tmp_w == tmp_h)
 	{
-		printf("WARNING: Input buffer underrun.\n");
-		
 		/* If input buffer is empty (EOF or something) just exit */
-		if(state & STATE_FINISHED)
+		if(state)
 		{
 			wptr = NULL;
 			goto out;
 		}
 	
 		/* If the input still goes on we need to wait */
-		pthread_cond_wait(&cb->e_cond, &cb->e_cond_lock);
+		cb_wait(&cb->w, &cb->w_waiters, tmp_w);
+		tmp_w = atomic_load_explicit(&cb->w, memory_order_acquire);
 	}
 	
 	/* Get current position in input ring buffer */
-	rptr = &cb->data[buf->num_samples * 2 * (cb->r & (cb->size - 1))];
+	rptr = (int16_t *)cb->slots[tmp_h & (cb->size - 1)];
+	device->h = (tmp_h + 1) & (2 * cb->size - 1);
+	trace_slot(device, tmp_h, 0);
+
+	/* The slot itself goes out, it is released when it comes back */
+	if(buf->zero_copy)
+	{
+		wptr = rptr;
+		goto out;
+	}
 	
 	/* Get the current slot in the target buffers */
-	wptr = (int16_t *)buf->sbuf[buf->pos];
+	wptr = (int16_t *)device->sbuf[device->pos];
 	
 	/* I'd like to avoid, but... */
-	memcpy(wptr, rptr, buf->num_samples * 2 * sizeof(int16_t));
+	if(device->channel >= 0)
+		split_channel(device, rptr, wptr);
+	else
+		memcpy(wptr, rptr, device->num_samples * 2 * sizeof(int16_t));
 	
 	/* Advance to the next slot */
-	buf->pos = (buf->pos + 1) % buf->num_buffers;
-
-	/* Advance input ring pointer */
-	pthread_mutex_lock(&cb->r_lock);
-	cb->r = (cb->r + 1) & (2 * cb->size - 1);
-	pthread_mutex_unlock(&cb->r_lock);
+	device->pos = (device->pos + 1) % buf->num_buffers;
 
-	/* Signal that buffer is now filled again */
-	pthread_cond_signal(&cb->f_cond);
+	/* Advance input ring pointer, wakes the reader if it waits
+	 * for a free slot */
+	cb_publish(r, &cb->r_waiters, device->h);
 	
 	
 out:
+	if(wptr)
+		stats_add_shared(&buf->stats.slots, 1);
+
 	return wptr;
 }
 
-float scale_and_autogain(
-		float *__restrict__ in,
-		int16_t *__restrict__ out,
-		float gain,
-		float again)
+/* What the streams are set up for, the TX module or both TX
+ * channels of a bladeRF 2.0
+ */
+static bladerf_module tx_layout(const struct devinfo_s *device)
 {
-	int m;
-	int32_t i_i32, q_i32;
+#ifdef HAVE_MIMO
+	if(device->mimo)
+		return BLADERF_TX_X2;
+#endif
 
+	return BLADERF_MODULE_TX;
+}
 
-	/* Allow for unrolling and auto vectorization */
-	for(m = 0; m < UNROLL_FACTOR; m++)
-	{
-		float i_in = in[m * 2];
-		float q_in = in[m * 2 + 1];
-		
-		/* Multiply by current soft gain */
-		float i = i_in * gain;
-		float q = q_in * gain;
+/* Wait for this many samples of the device clock, or until we are
+ * told to stop
+ */
+static void sync_sleep(struct devinfo_s *device, uint64_t samples)
+{
+	unsigned long long ns = samples * 1000000000ULL / device->samplerate;
+	struct timespec ts;
+
+	while(ns && !(state & STATE_EXIT))
+	{
+		ts.tv_sec = 0;
+		ts.tv_nsec = ns < CB_WAIT_TIMEOUT_NS ? ns : CB_WAIT_TIMEOUT_NS;
+		ns -= ts.tv_nsec;
+
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Send one buffer with the sync API, opening a burst first if
+ * there is none. Returns the libbladeRF error.
+ */
+static int sync_send(struct devinfo_s *device, void *ptr, unsigned int n,
+		bool *burst, bool last)
+{
+	struct buffer_s *buf = device->buffers;
+	struct bladerf_metadata *mp = NULL;
+	int ret;
+
+#ifdef HAVE_TX_META
+	struct bladerf_metadata meta;
+	uint64_t now, lead;
+
+	if(buf->timestamps)
+	{
+		memset(&meta, 0, sizeof(meta));
+		mp = &meta;
+
+		if(!*burst)
+		{
+			meta.flags = BLADERF_META_FLAG_TX_BURST_START;
+			device->air_known = false;
+
+			if(!buf->tx_delay && !buf->cb.quiet)
+				meta.flags |= BLADERF_META_FLAG_TX_NOW;
+			else
+			{
+				ret = bladerf_get_timestamp(device->dev,
+					BLADERF_MODULE_TX, &now);
+				if(ret != 0)
+					return ret;
+
+				device->air_t = stats_now();
+				device->air_ts = now;
+
+				lead = (uint64_t)(buf->tx_delay > GATE_LEAD_MS ?
+					buf->tx_delay : GATE_LEAD_MS) * device->samplerate / 1000;
+
+				/* After a quiet stretch the burst goes where the
+				 * skipped slots end, if there is still time */
+				if(device->gap && device->ts >= now + lead)
+				{
+					sync_sleep(device, device->ts - lead - now);
+					meta.timestamp = device->ts;
+				}
+				else if(buf->tx_delay)
+					meta.timestamp = now + (uint64_t)buf->tx_delay
+						* device->samplerate / 1000;
+				else
+				{
+					meta.flags |= BLADERF_META_FLAG_TX_NOW;
+					meta.timestamp = now;
+				}
+
+				device->ts = meta.timestamp;
+				device->gap = false;
+				device->air_known = !(meta.flags & BLADERF_META_FLAG_TX_NOW);
+			}
+		}
+
+		if(last)
+			meta.flags |= BLADERF_META_FLAG_TX_BURST_END;
+	}
+#endif
+
+	stats_callback(&buf->stats, &device->clock);
+
+	ret = bladerf_sync_tx(device->dev, ptr, n, mp, SYNC_TIMEOUT_MS);
+	if(ret != 0)
+		return ret;
+
+	stats_add_shared(&buf->stats.slots, 1);
+	device->ts += n;
+
+	/* Without metadata there are no bursts to keep track of */
+	*burst = buf->timestamps && !last;
+
+	return 0;
+}
+
+/* A ring slot the way this device sends it
+ */
+static void *sync_slot(struct devinfo_s *device, unsigned int idx)
+{
+	struct cb_s *cb = &device->buffers->cb;
+	int16_t *ptr = cb->slots[idx & (cb->size - 1)];
+
+	if(device->channel < 0)
+		return ptr;
+
+	split_channel(device, ptr, device->split);
+
+	return device->split;
+}
+
+/* Whether the slot is quiet and has been long enough to gate TX off
+ */
+static bool sync_gated(struct devinfo_s *device, unsigned int idx)
+{
+	struct buffer_s *buf = device->buffers;
+	struct cb_s *cb = &buf->cb;
+
+	if(!cb->quiet || !cb->quiet[idx & (cb->size - 1)])
+	{
+		device->quiet_run = 0;
+		return false;
+	}
+
+	device->quiet_run++;
+
+	return (uint64_t)device->quiet_run * device->num_samples * 1000
+		> (uint64_t)buf->hangover * device->samplerate;
+}
+
+/* The sync engine, takes the place of the stream callback and
+ * runs until the input or the user says stop. bladerf_sync_tx()
+ * copies the samples, so ring slots go back right after it.
+ */
+static int sync_run(struct devinfo_s *device)
+{
+	struct buffer_s *buf = device->buffers;
+	struct cb_s *cb = &buf->cb;
+	atomic_uint *r = &cb->r[device->index].pos;
+	unsigned int tmp_w, tmp_h;
+	bool burst = false;
+	size_t n;
+	int ret = 0;
+
+	while(!(state & STATE_EXIT))
+	{
+		/* The image is sent right from where it is */
+		if(buf->loop)
+		{
+			n = buf->image_len - buf->image_pos;
+			if(n > device->num_samples)
+				n = device->num_samples;
+
+			ret = sync_send(device, &buf->image[2 * buf->image_pos], n,
+				&burst, false);
+
+			buf->image_pos = (buf->image_pos + n) % buf->image_len;
+		}
+		else
+		{
+			tmp_h = device->h;
+			tmp_w = atomic_load_explicit(&cb->w, memory_order_acquire);
+
+			stats_fill(&buf->stats, (tmp_w - tmp_h) & (2 * cb->size - 1));
+
+			if(tmp_w == tmp_h)
+			{
+				/* End of input */
+				if(state)
+					break;
+
+				stats_add_shared(&buf->stats.underruns, 1);
+
+				switch(buf->underrun)
+				{
+					case UNDERRUN_ZERO:
+						ret = sync_send(device, buf->silence,
+							device->num_samples, &burst, false);
+						break;
+					case UNDERRUN_REPEAT:
+						/* The last slot is held back for this */
+						ret = sync_send(device, sync_slot(device, tmp_h - 1),
+							device->num_samples, &burst, false);
+						break;
+					case UNDERRUN_GATE:
+						/* Close the burst with a slot of silence, the
+						 * next one starts at a new timestamp */
+						if(burst)
+							ret = sync_send(device, buf->silence,
+								device->num_samples, &burst, true);
+						/* fall through */
+					default:
+						cb_wait(&cb->w, &cb->w_waiters, tmp_w);
+				}
+			}
+			else if(sync_gated(device, tmp_h))
+			{
+				/* Closed with the first slot past the hangover, the
+				 * rest is skipped but keeps the time */
+				if(burst)
+				{
+					ret = sync_send(device, sync_slot(device, tmp_h),
+						device->num_samples, &burst, true);
+					trace_slot(device, tmp_h, device->ts - device->num_samples);
+				}
+				else
+				{
+					stats_add_shared(&buf->stats.gated, 1);
+					device->ts += device->num_samples;
+					device->gap = true;
+				}
+
+				device->h = (tmp_h + 1) & (2 * cb->size - 1);
+				cb_publish(r, &cb->r_waiters,
+					buf->underrun == UNDERRUN_REPEAT ?
+					tmp_h : device->h);
+			}
+			else
+			{
+				ret = sync_send(device, sync_slot(device, tmp_h),
+					device->num_samples, &burst, false);
+				trace_slot(device, tmp_h, device->ts - device->num_samples);
+
+				device->h = (tmp_h + 1) & (2 * cb->size - 1);
+
+				/* Repeating needs the slot just sent, so ours lags
+				 * one behind then */
+				cb_publish(r, &cb->r_waiters,
+					buf->underrun == UNDERRUN_REPEAT ?
+					tmp_h : device->h);
+			}
+		}
+
+		if(ret != 0)
+		{
+			fprintf(stderr, "Error sending samples: %s.\n",
+				bladerf_strerror(ret));
+			return ret;
+		}
+	}
+
+	/* Let the last burst end properly */
+	if(burst)
+	{
+		ret = sync_send(device, buf->silence, device->num_samples,
+			&burst, true);
+		if(ret != 0)
+			fprintf(stderr, "Error ending burst: %s.\n",
+				bladerf_strerror(ret));
+	}
+
+	return ret;
+}
+
+/* Set up the sync engine
+ */
+static int setup_sync(struct devinfo_s *device)
+{
+	struct buffer_s *buf = device->buffers;
+	int ret;
+
+	ret = bladerf_sync_config(device->dev, tx_layout(device),
+#ifdef HAVE_TX_META
+		buf->timestamps ? BLADERF_FORMAT_SC16_Q11_META :
+#endif
+		BLADERF_FORMAT_SC16_Q12,
+		buf->num_buffers, device->num_samples, buf->num_transfers,
+		SYNC_TIMEOUT_MS);
+	if(ret != 0)
+		fprintf(stderr, "Failed setting up sync TX: %s.\n",
+			bladerf_strerror(ret));
+
+	return ret;
+}
+
+/* Convert any number of samples, in UNROLL_FACTOR blocks
+ */
+static void convert(struct buffer_s *buf, const void *in, int16_t *out,
+		size_t n)
+{
+	const unsigned int size = formats[buf->format].size;
+	unsigned long long t = stats_now();
+	size_t m;
+
+	/* Already SC16_Q12 and nothing to scale */
+	if(buf->passthrough)
+	{
+		if(in != out)
+			memcpy(out, in, n * size);
+	}
+	else
+	{
+		/* Convert to int16 and auto gain control */
+		for(m = 0; m < n; m += UNROLL_FACTOR)
+		{
+			scale_and_autogain(
+				buf->kernel,
+				&buf->agc,
+				&buf->dsp,
+				buf->index + m,
+				(const char *)in + m * size,
+				&out[2 * m],
+				n - m < UNROLL_FACTOR ? n - m : UNROLL_FACTOR);
+		}
+	}
+
+	buf->index += n;
+
+	stats_add(&buf->stats.converted, n);
+	stats_add(&buf->stats.convert_ns, stats_now() - t);
+}
+
+/* Open the input file, map it if wanted and possible. A file that is
+ * already open is taken as it is.
+ */
+static int open_input(struct buffer_s *buf, const char *name, FILE *file)
+{
+	struct stat st;
+	void *map;
+	int flags = MAP_SHARED, fd;
+
+	buf->map = NULL;
+	buf->map_pos = 0;
+
+	/* Sockets are streams, UDP comes through the jitter buffer */
+	switch(net_kind(name)) {
+		case NET_UDP:
+			buf->input = INPUT_STREAM;
+			buf->udp = true;
+			buf->net.fill = buf->format == FORMAT_CU8 ? 128 : 0;
+			return net_udp_open(&buf->net, name, &buf->stats);
+
+		case NET_TCP:
+			buf->input = INPUT_STREAM;
+			fd = net_tcp(name);
+			if(fd < 0)
+				return -1;
+
+			buf->file = fdopen(fd, "r");
+			if(buf->file == NULL)
+			{
+				fprintf(stderr, "Error opening input: %s\n", strerror(errno));
+				close(fd);
+				return -1;
+			}
+			return 0;
+	}
+
+	/* Open input file (if not '-') */
+	if(strncmp("-", name, 1))
+	{
+		buf->file = file ? file : fopen(name, "r");
+		if(buf->file == NULL)
+		{
+			fprintf(stderr, "Error opening input file: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	else
+		buf->file = stdin;
+
+	if(buf->input == INPUT_STREAM)
+		return 0;
+
+	/* Pipes and the like still need fread() */
+	if(fstat(fileno(buf->file), &st) || !S_ISREG(st.st_mode) || !st.st_size)
+	{
+		fprintf(stderr, "Input is not a regular file, reading it as a "
+			"stream.\n");
+		buf->input = INPUT_STREAM;
+		return 0;
+	}
+
+	if(buf->input == INPUT_URING)
+	{
+		/* The loop image is read once through stdio */
+		if(buf->loop)
+		{
+			buf->input = INPUT_STREAM;
+			return 0;
+		}
+
+		if(uring_open(&buf->uring, fileno(buf->file), buf->uring_depth,
+			buf->cb.r_size))
+		{
+			fprintf(stderr, "io_uring is not available (%s), reading the "
+				"input with read().\n", strerror(errno));
+			buf->input = INPUT_STREAM;
+			return 0;
+		}
+
+		fprintf(stderr, "Reading ahead %u blocks of %lukB with io_uring%s.\n",
+			buf->uring.depth, (unsigned long)(buf->uring.block >> 10),
+			buf->uring.direct ? ", bypassing the page cache" : "");
+
+		return 0;
+	}
+
+	if(buf->input == INPUT_POPULATE)
+		flags |= MAP_POPULATE;
+
+	map = mmap(NULL, st.st_size, PROT_READ, flags, fileno(buf->file), 0);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "Error mapping input file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* We only ever walk through it once, front to back */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	buf->map = map;
+	buf->map_size = st.st_size;
+
+	fprintf(stderr, "Input file mapped (%lukB).\n",
+		(unsigned long)(buf->map_size >> 10));
+
+	return 0;
+}
+
+/* Let go of the entry that ended, its file and whatever reads it
+ */
+static void close_input(struct buffer_s *buf)
+{
+	if(buf->map)
+		munmap((void *)buf->map, buf->map_size);
+	buf->map = NULL;
+
+	if(buf->input == INPUT_URING)
+		uring_close(&buf->uring);
+
+	if(buf->file && buf->file != stdin)
+		fclose(buf->file);
+	buf->file = NULL;
+}
+
+/* Everything playlist_load() made
+ */
+static void playlist_free(struct playlist_s *list)
+{
+	unsigned int n;
+
+	for(n = 0; n < list->num_entries; n++)
+		free(list->entries[n].name);
+	free(list->entries);
+
+	if(list->next)
+		fclose(list->next);
+
+	list->entries = NULL;
+	list->num_entries = 0;
+	list->next = NULL;
+}
+
+/* Read a playlist, one file a line, each optionally followed by its
+ * format and soft gain, the defaults otherwise. # starts a comment.
+ */
+static int playlist_load(struct playlist_s *list, const char *path,
+		unsigned int format, float gain)
+{
+	char line[PATH_MAX + CONTROL_LINE], *name, *tok, *end, *save;
+	struct entry_s *tmp, *e;
+	unsigned int lineno = 0, n;
+	FILE *f;
+
+	list->entries = NULL;
+	list->num_entries = 0;
+	list->cur = 0;
+	list->next = NULL;
+	list->gain_held = false;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+	{
+		fprintf(stderr, "Error opening playlist: %s\n", strerror(errno));
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), f))
+	{
+		lineno++;
+
+		tok = strchr(line, '#');
+		if(tok)
+			*tok = '\0';
+
+		name = strtok_r(line, " \t\r\n", &save);
+		if(!name)
+			continue;
+
+		tmp = realloc(list->entries, (list->num_entries + 1) * sizeof(*tmp));
+		if(!tmp)
+			goto nomem;
+
+		list->entries = tmp;
+		e = &tmp[list->num_entries];
+		e->name = strdup(name);
+		if(!e->name)
+			goto nomem;
+
+		e->format = format;
+		e->gain = gain;
+		list->num_entries++;
+
+		while((tok = strtok_r(NULL, " \t\r\n", &save)))
+		{
+			for(n = 0; n < FORMAT_COUNT; n++)
+				if(!strcmp(tok, formats[n].name))
+					break;
+
+			if(n < FORMAT_COUNT)
+			{
+				e->format = n;
+				continue;
+			}
+
+			e->gain = strtof(tok, &end);
+			if(end == tok || *end || e->gain < 0.f)
+			{
+				fprintf(stderr, "Playlist line %u: \"%s\" is neither a "
+					"format nor a gain.\n", lineno, tok);
+				goto error;
+			}
+		}
+
+		/* Only files end, and can be opened before they play */
+		if(!strcmp(name, "-") || net_kind(name) != NET_NONE
+			|| !strncmp(name, GEN_PREFIX, strlen(GEN_PREFIX))
+			|| !strncmp(name, PLAYLIST_PREFIX, strlen(PLAYLIST_PREFIX)))
+		{
+			fprintf(stderr, "Playlist line %u: entries must be files.\n",
+				lineno);
+			goto error;
+		}
+	}
+
+	if(ferror(f))
+	{
+		fprintf(stderr, "Error reading playlist: %s\n", strerror(errno));
+		goto error;
+	}
+
+	fclose(f);
+
+	if(!list->num_entries)
+	{
+		fprintf(stderr, "The playlist is empty.\n");
+		return -1;
+	}
+
+	return 0;
+
+nomem:
+	fprintf(stderr, "Error allocating the playlist.\n");
+error:
+	fclose(f);
+	playlist_free(list);
+	return -1;
+}
+
+/* Make the current entry the input, and have the kernel start on the
+ * one after it while this one plays
+ */
+static int playlist_open(struct buffer_s *buf)
+{
+	struct playlist_s *list = &buf->list;
+	struct entry_s *e = &list->entries[list->cur];
+	FILE *file = list->next;
+
+	list->next = NULL;
+
+	buf->format = e->format;
+	buf->kernel = kernel_select(e->format);
+	if(!list->gain_held && e->gain != buf->agc.soft_gain)
+		agc_set_gain(&buf->agc, e->gain);
+
+	/* A partial sample at the end of the last one is dropped */
+	buf->cb.f_pos = 0;
+	buf->cb.f_len = 0;
+
+	if(open_input(buf, e->name, file))
+		return -1;
+
+	fprintf(stderr, "Playing %s (%u of %u, %s).\n", e->name, list->cur + 1,
+		list->num_entries, formats[e->format].name);
+
+	if(list->cur + 1 < list->num_entries)
+	{
+		list->next = fopen(list->entries[list->cur + 1].name, "r");
+		if(list->next)
+			posix_fadvise(fileno(list->next), 0, PLAYLIST_PREFETCH,
+				POSIX_FADV_WILLNEED);
+	}
+
+	return 0;
+}
+
+/* The current entry ended, go on with the next one that opens.
+ * Returns whether there was one
+ */
+static bool playlist_next(struct buffer_s *buf)
+{
+	struct playlist_s *list = &buf->list;
+
+	while(list->cur + 1 < list->num_entries)
+	{
+		close_input(buf);
+		list->cur++;
+
+		if(!playlist_open(buf))
+			return true;
+
+		fprintf(stderr, "Skipping %s.\n", list->entries[list->cur].name);
+	}
+
+	return false;
+}
+
+/* read() from the input, or from the network. The time it takes is
+ * counted, a network input that stays quiet is waited for until we
+ * are told to stop, which looks like an interrupted read().
+ */
+static ssize_t input_read(struct buffer_s *buf, void *ptr, size_t len)
+{
+	unsigned long long t = stats_now();
+	ssize_t nread;
+
+	for(;;)
+	{
+		if(buf->udp)
+			nread = net_udp_read(&buf->net, ptr, len);
+		else if(buf->input == INPUT_URING)
+			nread = uring_read(&buf->uring, ptr, len);
+		else
+			nread = read(fileno(buf->file), ptr, len);
+
+		if(nread >= 0 || errno != EAGAIN)
+			break;
+
+		if(state & STATE_EXIT)
+		{
+			errno = EINTR;
+			break;
+		}
+	}
+
+	stats_add(&buf->stats.read_ns, stats_now() - t);
+
+	return nread;
+}
+
+/* The next block of up to UNROLL_FACTOR whole samples, right in
+ * the map or read into fbuf. Returns the number of samples, 0 at
+ * the end of the input.
+ */
+static size_t input_block(struct buffer_s *buf, const void **in)
+{
+	struct cb_s *cb = &buf->cb;
+	char *fbuf = cb->fbuf;
+	const unsigned int size = formats[buf->format].size;
+	ssize_t nread;
+	size_t n;
+
+	if(buf->map)
+	{
+		n = (buf->map_size - buf->map_pos) / size;
+		if(n > UNROLL_FACTOR)
+			n = UNROLL_FACTOR;
+
+		*in = buf->map + buf->map_pos;
+		buf->map_pos += n * size;
+
+		return n;
+	}
+
+	while(cb->f_len - cb->f_pos < UNROLL_FACTOR * size)
+	{
+		/* Move the leftovers to the front if the next read
+		 * wouldn't fit */
+		if(cb->f_size - cb->f_len < cb->r_size)
+		{
+			memmove(fbuf, &fbuf[cb->f_pos], cb->f_len - cb->f_pos);
+			cb->f_len -= cb->f_pos;
+			cb->f_pos = 0;
+		}
+
+		nread = input_read(buf, &fbuf[cb->f_len], cb->r_size);
+
+		if(nread > 0)
+		{
+			cb->f_len += nread;
+			continue;
+		}
+
+		if(nread < 0 && errno == EINTR && !(state & STATE_EXIT))
+			continue;
+
+		if(nread < 0 && errno != EINTR)
+			fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+
+		break;
+	}
+
+	n = (cb->f_len - cb->f_pos) / size;
+	if(n > UNROLL_FACTOR)
+		n = UNROLL_FACTOR;
+
+	*in = &fbuf[cb->f_pos];
+	cb->f_pos += n * size;
+
+	return n;
+}
+
+/* Resample len samples into the slot, feeding the filter whenever it
+ * runs dry. The input ending lets the filter's tail out, a playlist
+ * going on to the next entry doesn't.
+ * Returns the number of samples, less than len at the end
+ */
+static size_t fill_resampled(struct buffer_s *buf, int16_t *ptr, size_t len)
+{
+	struct resampler_s *rs = &buf->resampler;
+	const void *in;
+	unsigned long long t;
+	size_t done = 0, n;
+
+	while(done < len && !(state & STATE_EXIT))
+	{
+		n = resampler_ready(rs);
+
+		if(!n)
+		{
+			if(rs->flushed)
+				break;
+
+			n = input_block(buf, &in);
+			if(!n && playlist_next(buf))
+				continue;
+
+			t = stats_now();
+			if(n)
+				resampler_push(rs, buf->kernel, in, n);
+			else
+				resampler_flush(rs);
+			stats_add(&buf->stats.convert_ns, stats_now() - t);
+
+			continue;
+		}
+
+		if(n > len - done)
+			n = len - done;
+		if(n > UNROLL_FACTOR)
+			n = UNROLL_FACTOR;
+
+		t = stats_now();
+		resample_and_autogain(rs, &buf->agc, &buf->dsp, buf->index,
+			&ptr[2 * done], n);
+		buf->index += n;
+		stats_add(&buf->stats.converted, n);
+		stats_add(&buf->stats.convert_ns, stats_now() - t);
+
+		done += n;
+	}
+
+	return done;
+}
+
+/* Read and convert the whole input into the loop image
+ */
+static int load_image(struct buffer_s *buf)
+{
+	size_t nread, alloc = 0;
+	int16_t *tmp, *out;
+
+	buf->image = NULL;
+	buf->image_len = 0;
+	buf->image_pos = 0;
+
+	if(buf->gen.kind)
+	{
+		/* Whole periods, or a stretch of noise */
+		buf->image_len = buf->gen.table ? buf->gen.table_len
+			: GEN_NOISE_PERIOD * buf->channels;
+		buf->image = malloc(buf->image_len * 2 * sizeof(int16_t));
+		if(!buf->image)
+			goto fail;
+
+		gen_fill(&buf->gen, buf->image, buf->image_len);
+	}
+	else if(buf->resample)
+	{
+		/* No telling how much comes out, a slot at a time */
+		do
+		{
+			if(buf->image_len + buf->num_samples > alloc)
+			{
+				alloc = alloc ? alloc * 2 : 16 * (size_t)buf->num_samples;
+				tmp = realloc(buf->image, alloc * 2 * sizeof(int16_t));
+				if(!tmp)
+					goto fail;
+
+				buf->image = tmp;
+			}
+
+			nread = fill_resampled(buf, &buf->image[2 * buf->image_len],
+				buf->num_samples);
+			buf->image_len += nread;
+		}
+		while(nread == buf->num_samples);
+	}
+	else if(buf->map)
+	{
+		/* Everything is there already */
+		buf->image_len = buf->map_size / formats[buf->format].size;
+		buf->image = malloc(buf->image_len * 2 * sizeof(int16_t));
+		if(!buf->image)
+			goto fail;
+
+		convert(buf, buf->map, buf->image, buf->image_len);
+	}
+	else
+	{
+		/* Read whole samples until EOF, one block at a time */
+		do
+		{
+			if(buf->image_len + UNROLL_FACTOR > alloc)
+			{
+				alloc = alloc ? alloc * 2 : 16 * (size_t)UNROLL_FACTOR;
+				tmp = realloc(buf->image, alloc * 2 * sizeof(int16_t));
+				if(!tmp)
+					goto fail;
+
+				buf->image = tmp;
+			}
+
+			out = &buf->image[2 * buf->image_len];
+
+			/* Q12 input goes straight into the image */
+			nread = fread(buf->passthrough ? out : buf->cb.fbuf,
+				formats[buf->format].size, UNROLL_FACTOR, buf->file);
+
+			convert(buf, buf->passthrough ? out : buf->cb.fbuf, out, nread);
+			buf->image_len += nread;
+		}
+		while(nread == UNROLL_FACTOR && !(state & STATE_EXIT));
+
+		if(ferror(buf->file))
+		{
+			fprintf(stderr, "Error reading input file.\n");
+			return -1;
+		}
+	}
+
+	if(!buf->image_len)
+	{
+		fprintf(stderr, "Nothing to loop.\n");
+		return -1;
+	}
+
+	fprintf(stderr, "Loop image ready, %lu samples (%lukB).\n",
+		(unsigned long)buf->image_len,
+		(unsigned long)((buf->image_len * 2 * sizeof(int16_t)) >> 10));
+
+	return 0;
+
+fail:
+	fprintf(stderr, "Error allocating loop image.\n");
+	return -1;
+}
+
+/* Convert len samples straight from the mapping
+ * Returns the number of samples, less than len at the end
+ */
+static size_t fill_from_map(struct buffer_s *buf, int16_t *ptr, size_t len)
+{
+	const unsigned int size = formats[buf->format].size;
+	size_t n = (buf->map_size - buf->map_pos) / size;
+
+	if(n > len)
+		n = len;
+
+	convert(buf, buf->map + buf->map_pos, ptr, n);
+	buf->map_pos += n * size;
+
+	return n;
+}
+
+/* Read exactly len bytes unless the input ends first
+ * Returns the number of bytes read
+ */
+static size_t read_fully(struct buffer_s *buf, void *ptr, size_t len)
+{
+	size_t have = 0, want;
+	ssize_t nread;
+
+	while(have < len)
+	{
+		want = len - have;
+		if(want > buf->cb.r_size)
+			want = buf->cb.r_size;
+
+		nread = input_read(buf, (char *)ptr + have, want);
+
+		if(nread > 0)
+			have += nread;
+		else if(nread < 0 && errno == EINTR && !(state & STATE_EXIT))
+			continue;
+		else
+		{
+			if(nread < 0 && errno != EINTR)
+				fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+
+			break;
+		}
+	}
+
+	return have;
+}
+
+/* Read len samples of Q12 input right into the slot
+ * Returns the number of samples, less than len on EOF
+ */
+static size_t fill_passthrough(struct buffer_s *buf, int16_t *ptr,
+		size_t len)
+{
+	size_t n = read_fully(buf, ptr, len * 2 * sizeof(int16_t))
+		/ (2 * sizeof(int16_t));
+
+	stats_add(&buf->stats.converted, n);
+
+	return n;
+}
+
+/* Read until len samples are in, whatever read() hands us at a time.
+ * Every UNROLL_FACTOR samples get converted as soon as they are in,
+ * partial samples and blocks stay in fbuf for the next round.
+ * Returns the number of samples, less than len on EOF
+ */
+static size_t fill_from_stream(struct buffer_s *buf, int16_t *ptr,
+		size_t len)
+{
+	struct cb_s *cb = &buf->cb;
+	char *fbuf = cb->fbuf;
+	const unsigned int size = formats[buf->format].size;
+	size_t done = 0, want;
+	ssize_t nread;
+
+	while(done < len)
+	{
+		want = len - done;
+		if(want > UNROLL_FACTOR)
+			want = UNROLL_FACTOR;
+
+		/* Enough there for the next block */
+		if(cb->f_len - cb->f_pos >= want * size)
+		{
+			convert(buf, &fbuf[cb->f_pos], &ptr[2 * done], want);
+			cb->f_pos += want * size;
+			done += want;
+			continue;
+		}
+
+		/* Move the leftovers to the front if the next read
+		 * wouldn't fit */
+		if(cb->f_size - cb->f_len < cb->r_size)
+		{
+			memmove(fbuf, &fbuf[cb->f_pos], cb->f_len - cb->f_pos);
+			cb->f_len -= cb->f_pos;
+			cb->f_pos = 0;
+		}
+
+		nread = input_read(buf, &fbuf[cb->f_len], cb->r_size);
+
+		if(nread > 0)
+		{
+			cb->f_len += nread;
+			continue;
+		}
+
+		if(nread < 0 && errno == EINTR && !(state & STATE_EXIT))
+			continue;
+
+		if(nread < 0 && errno != EINTR)
+			fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+
+		/* No more input, convert what is left of whole samples */
+		want = (cb->f_len - cb->f_pos) / size;
+		convert(buf, &fbuf[cb->f_pos], &ptr[2 * done], want);
+		cb->f_pos += want * size;
+		done += want;
+		break;
+	}
+
+	return done;
+}
+
+/* Make len samples of the generated signal, it never ends
+ */
+static size_t fill_generated(struct buffer_s *buf, int16_t *ptr,
+		size_t len)
+{
+	unsigned long long t = stats_now();
+
+	gen_fill(&buf->gen, ptr, len);
+
+	stats_add(&buf->stats.converted, len);
+	stats_add(&buf->stats.convert_ns, stats_now() - t);
+
+	return len;
+}
+
+/* Fill a slot whichever way the input needs, going on with the next
+ * entry of a playlist wherever one ends
+ * Returns the number of samples, less than a slot at the end
+ */
+static size_t fill_slot(struct buffer_s *buf, int16_t *ptr)
+{
+	size_t n = 0, len = buf->num_samples;
+
+	do
+	{
+		if(buf->gen.kind)
+			n += fill_generated(buf, &ptr[2 * n], len - n);
+		else if(buf->resample)
+			n += fill_resampled(buf, &ptr[2 * n], len - n);
+		else if(buf->map)
+			n += fill_from_map(buf, &ptr[2 * n], len - n);
+		else if(buf->passthrough)
+			n += fill_passthrough(buf, &ptr[2 * n], len - n);
+		else
+			n += fill_from_stream(buf, &ptr[2 * n], len - n);
+	}
+	while(n < len && !(state & STATE_EXIT) && playlist_next(buf));
+
+	return n;
+}
+
+/* Take a soft gain the control thread left us, between two slots
+ */
+static void reader_gain(struct buffer_s *buf)
+{
+	unsigned int bits = atomic_load_explicit(&buf->gain_req,
+		memory_order_relaxed);
+	float gain;
+
+	if(bits == buf->gain_bits)
+		return;
+
+	buf->gain_bits = bits;
+	memcpy(&gain, &bits, sizeof(gain));
+	agc_set_gain(&buf->agc, gain);
+
+	/* ...for the rest of a playlist too */
+	buf->list.gain_held = true;
+}
+
+/* Note whether a filled slot is quiet, before it's published
+ */
+static void mark_quiet(struct buffer_s *buf, unsigned int idx,
+		const int16_t *ptr)
+{
+	struct cb_s *cb = &buf->cb;
+
+	if(cb->quiet)
+		cb->quiet[idx & (cb->size - 1)] = q12_quiet(ptr, buf->num_samples,
+			buf->quiet_level);
+}
+
+/* Scale one job into its slot with the gains the reader chose
+ */
+static void convert_job(struct buffer_s *buf, struct job_s *job)
+{
+	const unsigned int size = formats[buf->format].size;
+	unsigned long long t = stats_now();
+	size_t m;
+	unsigned int b;
+
+	if(buf->passthrough)
+		memcpy(job->out, job->in, job->n * size);
+	else
+	{
+		for(m = 0, b = 0; m < job->n; m += UNROLL_FACTOR, b++)
+		{
+			kernel_scale(
+				buf->kernel,
+				&buf->dsp,
+				(const char *)job->in + m * size,
+				&job->out[2 * m],
+				job->n - m < UNROLL_FACTOR ? job->n - m : UNROLL_FACTOR,
+				job->gain[b],
+				job->step[b],
+				job->index + m);
+		}
+	}
+
+	/* The last slot of the input */
+	if(job->n < buf->num_samples)
+		memset(&job->out[2 * job->n], 0,
+			(buf->num_samples - job->n) * 2 * sizeof(int16_t));
+
+	mark_quiet(buf, job->slot, job->out);
+
+	stats_add_shared(&buf->stats.converted, job->n);
+	stats_add_shared(&buf->stats.convert_ns, stats_now() - t);
+}
+
+/* Take jobs in order and convert them. Whoever finishes publishes
+ * every job that is done from the oldest on, so w never passes a
+ * slot that is still being worked on.
+ */
+static void *worker_proc(void *arg)
+{
+	struct buffer_s *buf = (struct buffer_s *)(arg);
+	struct pool_s *pool = &buf->pool;
+	struct cb_s *cb = &buf->cb;
+	unsigned int seq, sub, c;
+	struct job_s *job;
+
+	while(!(state & STATE_EXIT))
+	{
+		seq = atomic_fetch_add(&pool->taken, 1);
+
+		/* Wait for the reader to hand it over. Once it's finished
+		 * everything submitted is published already. */
+		sub = atomic_load_explicit(&pool->submitted, memory_order_acquire);
+		while((int)(sub - seq) <= 0)
+		{
+			if(state)
+				goto out;
+
+			cb_wait(&pool->submitted, &pool->submitted_waiters, sub);
+			sub = atomic_load_explicit(&pool->submitted, memory_order_acquire);
+		}
+
+		job = &pool->jobs[seq & (pool->num_jobs - 1)];
+		convert_job(buf, job);
+		atomic_store_explicit(&job->done, seq + 1, memory_order_release);
+
+		pthread_mutex_lock(&pool->publish);
+
+		c = atomic_load_explicit(&pool->completed, memory_order_relaxed);
+		job = &pool->jobs[c & (pool->num_jobs - 1)];
+
+		if(atomic_load_explicit(&job->done, memory_order_acquire) == c + 1)
+		{
+			do
+			{
+				cb_publish(&cb->w, &cb->w_waiters,
+					(job->slot + 1) & (2 * cb->size - 1));
+
+				c++;
+				job = &pool->jobs[c & (pool->num_jobs - 1)];
+			}
+			while(atomic_load_explicit(&job->done,
+				memory_order_acquire) == c + 1);
+
+			/* Jobs are free for the reader again */
+			cb_publish(&pool->completed, &pool->completed_waiters, c);
+		}
+
+		pthread_mutex_unlock(&pool->publish);
+	}
+
+out:
+	pthread_exit(NULL);
+}
+
+/* Reader for the worker pool: read into a free job, decide on the
+ * gains and hand it over. Without a map the input is read raw.
+ */
+static void pool_reader(struct buffer_s *buf)
+{
+	struct pool_s *pool = &buf->pool;
+	struct cb_s *cb = &buf->cb;
+	const unsigned int size = formats[buf->format].size;
+	unsigned int claim = 0, seq = 0, c, b;
+	struct job_s *job;
+	size_t m, n;
+
+	while(!state)
+	{
+		/* The slot after the last one handed to the workers */
+		cb_wait_room(buf, claim);
+
+		/* The job buffer is free once its last use is published */
+		c = atomic_load_explicit(&pool->completed, memory_order_acquire);
+
+		while(!state && seq - c >= pool->num_jobs)
+		{
+			cb_wait(&pool->completed, &pool->completed_waiters, c);
+			c = atomic_load_explicit(&pool->completed, memory_order_acquire);
+		}
+
+		if(state & STATE_EXIT)
+			return;
+
+		reader_gain(buf);
+
+		job = &pool->jobs[seq & (pool->num_jobs - 1)];
+		job->slot = claim;
+		job->out = (int16_t *)cb->slots[claim & (cb->size - 1)];
+
+		if(buf->map)
+		{
+			n = (buf->map_size - buf->map_pos) / size;
+			if(n > buf->num_samples)
+				n = buf->num_samples;
+
+			job->in = buf->map + buf->map_pos;
+			buf->map_pos += n * size;
+		}
+		else
+		{
+			n = read_fully(buf, job->raw,
+				(size_t)buf->num_samples * size) / size;
+			job->in = job->raw;
+		}
+
+		trace_read(buf, claim);
+
+		job->n = n;
+		job->index = buf->index;
+		buf->index += n;
+
+		/* AGC lookahead, the gain follows the input in order here
+		 * and the workers just apply it */
+		if(!buf->passthrough)
+		{
+			for(m = 0, b = 0; m < n; m += UNROLL_FACTOR, b++)
+			{
+				job->gain[b] = agc_update(buf->kernel, &buf->agc,
+					(const char *)job->in + m * size,
+					n - m < UNROLL_FACTOR ? n - m : UNROLL_FACTOR,
+					&job->step[b]);
+			}
+		}
+
+		if(!n || (state & STATE_EXIT))
+			break;
+
+		seq++;
+		cb_publish(&pool->submitted, &pool->submitted_waiters, seq);
+		claim = (claim + 1) & (2 * cb->size - 1);
+
+		/* End of input, the last samples went out padded */
+		if(n < buf->num_samples)
+			break;
+	}
+
+	/* Let the workers drain before the consumer may call it a day */
+	c = atomic_load_explicit(&pool->completed, memory_order_acquire);
+
+	while(!state && c != seq)
+	{
+		cb_wait(&pool->completed, &pool->completed_waiters, c);
+		c = atomic_load_explicit(&pool->completed, memory_order_acquire);
+	}
+
+	state |= STATE_FINISHED;
+	cb_futex_wake(&pool->submitted);
+	cb_futex_wake(&cb->w);
+}
+
+/* Read, convert and scale input data
+ */
+static void *reader_proc(void *arg)
+{
+	struct buffer_s *buf = (struct buffer_s *)(arg);
+	struct cb_s *cb = &buf->cb;
+	unsigned int tmp_w;
+	int16_t *ptr;
+	size_t n;
+
+	if(buf->pool.num_workers)
+	{
+		pool_reader(buf);
+		goto out;
+	}
+
+	while(!state)
+	{
+		/* Acquire the read pointers, so the consumers are done with
+		 * the slot before we overwrite it */
+		tmp_w = atomic_load_explicit(&cb->w, memory_order_relaxed);
+
+		/* Check for overflow (full condition)
+		 * Wait until the slowest consumer signals a free slot */
+		cb_wait_room(buf, tmp_w);
+
+		/* User wants to exit now */
+		if(state & STATE_EXIT)
+			break;
 		
-		/* Calculate (squared) magnitude */
-		float s = i * i + q * q;
+		/* Get the current slot in the buffers */
+		ptr = (int16_t *)cb->slots[tmp_w & (cb->size - 1)];
+
+		reader_gain(buf);
+
+		n = fill_slot(buf, ptr);
+
+		/* End of input, the last samples still go out */
+		if(n < buf->num_samples)
+		{
+			if(n && !(state & STATE_EXIT))
+			{
+				memset(&ptr[2 * n], 0,
+					(buf->num_samples - n) * 2 * sizeof(int16_t));
+				mark_quiet(buf, tmp_w, ptr);
+				trace_read(buf, tmp_w);
+				cb_publish(&cb->w, &cb->w_waiters,
+					(tmp_w + 1) & (2 * cb->size - 1));
+			}
+
+			state |= STATE_FINISHED;
+			cb_futex_wake(&cb->w);
+			break;
+		}
 		
-		/* Check if auto gain control is enabled and
-		 * magnitude is over bounds */
-		if((again > 0.0) && (s > (again * again)))
+		/* Release the filled slot, wakes the consumer if it waits
+		 * for data */
+		mark_quiet(buf, tmp_w, ptr);
+		trace_read(buf, tmp_w);
+		cb_publish(&cb->w, &cb->w_waiters, (tmp_w + 1) & (2 * cb->size - 1));
+	}
+
+out:
+	if(buf->agc.adjustments)
+		fprintf(stderr, "Soft gain was adjusted %lu times, ended at %f.\n",
+			buf->agc.adjustments, buf->agc.gain);
+
+	pthread_exit(NULL);
+}
+
+/* Map the ring data, page aligned and so good for any SIMD kernel.
+ * Hugepages that aren't there fall back to THP, THP just doesn't
+ * happen if the kernel doesn't do it.
+ */
+static int ring_alloc(struct cb_s *cb, size_t len)
+{
+	const size_t huge_2m = 2UL << 20;
+	const int prot = PROT_READ | PROT_WRITE;
+	const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void *map = MAP_FAILED;
+	size_t align, size;
+	uintptr_t start;
+
+	if(cb->huge == HUGE_2M || cb->huge == HUGE_1G)
+	{
+		align = cb->huge == HUGE_2M ? huge_2m : 1UL << 30;
+		size = (len + align - 1) & ~(align - 1);
+
+		map = mmap(NULL, size, prot, flags | MAP_HUGETLB
+			| (cb->huge == HUGE_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB), -1, 0);
+
+		if(map == MAP_FAILED)
+		{
+			fprintf(stderr, "WARNING: No %s hugepages for the circular "
+				"buffer (%s), trying THP.\n", huge_names[cb->huge],
+				strerror(errno));
+			cb->huge = HUGE_THP;
+		}
+	}
+
+	if(cb->huge == HUGE_THP)
+	{
+		/* Map more and cut it down to 2MB boundaries */
+		size = (len + huge_2m - 1) & ~(huge_2m - 1);
+		map = mmap(NULL, size + huge_2m, prot, flags, -1, 0);
+
+		if(map != MAP_FAILED)
+		{
+			start = ((uintptr_t)map + huge_2m - 1) & ~(huge_2m - 1);
+
+			if(start != (uintptr_t)map)
+				munmap(map, start - (uintptr_t)map);
+			munmap((void *)(start + size),
+				(uintptr_t)map + huge_2m - start);
+
+			map = (void *)start;
+			madvise(map, size, MADV_HUGEPAGE);
+		}
+	}
+	else if(cb->huge == HUGE_NONE)
+	{
+		size = len;
+		map = mmap(NULL, size, prot, flags, -1, 0);
+	}
+
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "Error allocating circular buffer: %s\n",
+			strerror(errno));
+		cb->data = NULL;
+		return -1;
+	}
+
+	cb->data = map;
+	cb->data_size = size;
+
+	return 0;
+}
+
+/* The NUMA node a USB bus hangs off, -1 if there is none
+ */
+static int usb_numa_node(unsigned int bus)
+{
+	char path[64];
+	FILE *f;
+	int node = -1;
+
+	/* usbN links to the host controller's directory */
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%u/../numa_node",
+		bus);
+
+	f = fopen(path, "r");
+	if(!f)
+		return -1;
+
+	if(fscanf(f, "%i", &node) != 1)
+		node = -1;
+
+	fclose(f);
+
+	return node;
+}
+
+/* Prefer a NUMA node for the ring, pages already there move over
+ */
+static void ring_bind(struct cb_s *cb, int node)
+{
+	unsigned long mask[4] = { 0 };
+	const unsigned long bits = 8 * sizeof(unsigned long);
+
+	if(node < 0 || node >= (int)(sizeof(mask) * 8))
+		return;
+
+	mask[node / bits] = 1UL << (node % bits);
+
+	if(syscall(SYS_mbind, cb->data, cb->data_size, MPOL_PREFERRED, mask,
+		sizeof(mask) * 8, MPOL_MF_MOVE))
+	{
+		fprintf(stderr, "WARNING: Can't place the circular buffer on "
+			"node %i: %s.\n", node, strerror(errno));
+		return;
+	}
+
+	fprintf(stderr, "Circular buffer placed on NUMA node %i.\n", node);
+}
+
+/* Warn about underruns and print the stats when asked to
+ */
+static void *stats_proc(void *arg)
+{
+	struct buffer_s *buf = (struct buffer_s *)(arg);
+	const struct timespec tick = { 0, STATS_TICK_NS };
+	const unsigned long long interval =
+		buf->stats_interval * 1000000000ULL;
+	unsigned long long now, next, warned = 0, underruns, seen = 0;
+	struct budget_s budget = { 0, 0, 0, 0, 0 };
+
+	next = buf->stats_start.t + interval;
+
+	while(!(state & STATE_EXIT))
+	{
+		nanosleep(&tick, NULL);
+		now = stats_now();
+
+		/* Once a second at most, not from the callback */
+		underruns = atomic_load_explicit(&buf->stats.underruns,
+			memory_order_relaxed);
+		if(underruns != seen && now - warned >= 1000000000ULL)
+		{
+			fprintf(stderr, "WARNING: Input buffer underrun "
+				"(%llu so far).\n", underruns);
+			seen = underruns;
+			warned = now;
+		}
+
+		if(report_now || (interval && now >= next))
+		{
+			report_now = 0;
+			stats_report(stderr, &buf->stats, &buf->stats_last,
+				&buf->stats_start);
+			next = now + interval;
+		}
+
+		if(buf->budget && !buf->loop && now >= budget.next)
+			budget_step(buf, &budget, now);
+	}
+
+	pthread_exit(NULL);
+}
+
+/* The CPU for a thread, -1 if it isn't pinned
+ */
+static int rt_cpu(const struct rt_s *rt, unsigned int idx)
+{
+	return rt->num_cpus ? rt->cpus[idx % rt->num_cpus] : -1;
+}
+
+/* Priority of everybody but the streaming thread
+ */
+static int rt_priority(const struct rt_s *rt, unsigned int idx)
+{
+	if(!rt->priority || idx == RT_STREAM)
+		return rt->priority;
+
+	return rt->priority > 1 ? rt->priority - 1 : 1;
+}
+
+/* Parse a comma separated list of CPU numbers
+ */
+static int rt_parse_cpus(struct rt_s *rt, const char *list)
+{
+	const char *p;
+	char *end;
+	unsigned int n;
+
+	free(rt->cpus);
+	rt->cpus = NULL;
+	rt->num_cpus = 0;
+
+	for(n = 1, p = list; *p; p++)
+		if(*p == ',')
+			n++;
+
+	rt->cpus = malloc(n * sizeof(int));
+	if(!rt->cpus)
+		return -1;
+
+	for(p = list; rt->num_cpus < n; p = end + 1)
+	{
+		long cpu = strtol(p, &end, 10);
+
+		if(end == p || cpu < 0 || cpu >= CPU_SETSIZE
+			|| (*end && *end != ','))
+			return -1;
+
+		rt->cpus[rt->num_cpus++] = cpu;
+
+		if(!*end)
+			break;
+	}
+
+	return 0;
+}
+
+/* Show where a thread runs, for the log
+ */
+static void rt_describe(char *str, size_t len, int priority, int cpu)
+{
+	int n = 0;
+
+	str[0] = '\0';
+
+	if(priority)
+		n = snprintf(str, len, ", SCHED_FIFO %i", priority);
+	if(cpu >= 0 && n >= 0 && (size_t)n < len)
+		snprintf(str + n, len - n, ", CPU %i", cpu);
+}
+
+/* Start a thread with the given priority and CPU. If the system
+ * won't let us, it runs without them, that's better than not at all.
+ * desc (if not NULL) tells what it got.
+ */
+static int rt_thread_create(pthread_t *thread, void *(*proc)(void *),
+		void *arg, int priority, int cpu, char *desc, size_t len)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	cpu_set_t set;
+	int ret;
+
+	if(desc)
+		rt_describe(desc, len, priority, cpu);
+
+	if(!priority && cpu < 0)
+		return pthread_create(thread, NULL, proc, arg);
+
+	pthread_attr_init(&attr);
+
+	if(priority)
+	{
+		param.sched_priority = priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	if(cpu >= 0)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	ret = pthread_create(thread, &attr, proc, arg);
+	pthread_attr_destroy(&attr);
+
+	if(ret == EPERM || ret == EINVAL)
+	{
+		fprintf(stderr, "WARNING: Can't set thread priority or CPU (%s), "
+			"running without.\n", strerror(ret));
+		ret = pthread_create(thread, NULL, proc, arg);
+
+		if(desc)
+			desc[0] = '\0';
+	}
+
+	return ret;
+}
+
+/* Move the calling (streaming) thread where it belongs
+ */
+static void rt_thread_self(const struct rt_s *rt)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int ret, cpu = rt_cpu(rt, RT_STREAM);
+
+	if(rt->priority)
+	{
+		param.sched_priority = rt->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(ret)
+			fprintf(stderr, "WARNING: Can't set SCHED_FIFO priority %i: "
+				"%s.\n", rt->priority, strerror(ret));
+	}
+
+	if(cpu >= 0)
+	{
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(ret)
+			fprintf(stderr, "WARNING: Can't pin streaming thread to CPU %i: "
+				"%s.\n", cpu, strerror(ret));
+	}
+}
+
+/* Touch every page, so it is really there
+ */
+static void prefault(void *ptr, size_t len)
+{
+	volatile char *p = ptr;
+	size_t n, page = sysconf(_SC_PAGESIZE);
+
+	if(!p)
+		return;
+
+	for(n = 0; n < len; n += page)
+		p[n] = p[n];
+
+	if(len)
+		p[len - 1] = p[len - 1];
+}
+
+/* Lock everything we have and will get into RAM and fault in all
+ * the buffers on the TX path, so nothing has to be paged in once
+ * TX runs. The input mapping is left out, it can be any size.
+ */
+static void rt_lock_memory(struct devinfo_s *devices,
+		unsigned int num_devices)
+{
+	struct buffer_s *buf = devices[0].buffers;
+	struct cb_s *cb = &buf->cb;
+	const size_t slot = (size_t)buf->num_samples * 2 * sizeof(int16_t);
+	char stack[PREFAULT_STACK];
+	unsigned int n, d, num_sbuf;
+
+	if(mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "WARNING: Can't lock memory: %s.\n",
+			strerror(errno));
+
+	if(buf->map)
+		munlock(buf->map, buf->map_size);
+
+	/* Copy mode buffers, or the ring itself in zero-copy mode,
+	 * the sync engine has them inside libbladeRF */
+	num_sbuf = buf->engine == ENGINE_SYNC ? 0 : buf->zero_copy ?
+		cb->size + buf->num_transfers : buf->num_buffers;
+
+	for(d = 0; d < num_devices; d++)
+	{
+		for(n = 0; n < num_sbuf; n++)
+			prefault(devices[d].sbuf[n], slot);
+
+		prefault(devices[d].split, devices[d].split ? slot : 0);
+	}
+
+	prefault(cb->data, cb->data ? cb->size * slot : 0);
+	prefault(cb->fbuf, cb->fbuf ? cb->f_size : 0);
+	prefault(buf->silence, buf->silence ? slot : 0);
+	prefault(buf->image, buf->image_len * 2 * sizeof(int16_t));
+	prefault(buf->resampler.hist, buf->resampler.hist_size * 2 * sizeof(float));
+	prefault(buf->resampler.block, buf->resampler.block ?
+		UNROLL_FACTOR * 2 * sizeof(float) : 0);
+
+	for(n = 0; buf->pool.jobs && n < buf->pool.num_jobs; n++)
+		prefault(buf->pool.jobs[n].raw, buf->pool.jobs[n].raw ?
+			buf->num_samples * formats[buf->format].size : 0);
+
+	/* And the stack the callback runs on */
+	memset(stack, 0, sizeof(stack));
+	__asm__ __volatile__("" : : "r" (stack) : "memory");
+
+	fprintf(stderr, "Memory locked and faulted in.\n");
+}
+
+/* Allocate the jobs for the worker pool
+ */
+static int pool_init(struct buffer_s *buf)
+{
+	struct pool_s *pool = &buf->pool;
+	unsigned int n;
+
+	pool->started = 0;
+	pool->num_blocks = (buf->num_samples + UNROLL_FACTOR - 1) / UNROLL_FACTOR;
+	atomic_init(&pool->submitted, 0);
+	atomic_init(&pool->taken, 0);
+	atomic_init(&pool->completed, 0);
+	atomic_init(&pool->submitted_waiters, 0);
+	atomic_init(&pool->completed_waiters, 0);
+	pthread_mutex_init(&pool->publish, NULL);
+
+	pool->num_jobs = pool_num_jobs(pool->num_workers);
+
+	pool->jobs = calloc(pool->num_jobs, sizeof(*pool->jobs));
+	pool->threads = calloc(pool->num_workers, sizeof(*pool->threads));
+	if(!pool->jobs || !pool->threads)
+		goto fail;
+
+	for(n = 0; n < pool->num_jobs; n++)
+	{
+		struct job_s *job = &pool->jobs[n];
+
+		atomic_init(&job->done, 0);
+		job->gain = malloc(pool->num_blocks * sizeof(float));
+		job->step = malloc(pool->num_blocks * sizeof(float));
+		if(!job->gain || !job->step)
+			goto fail;
+
+		/* A mapping is read in place */
+		if(!buf->map)
+		{
+			job->raw = malloc((size_t)buf->num_samples
+				* formats[buf->format].size);
+			if(!job->raw)
+				goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	fprintf(stderr, "Error allocating conversion jobs.\n");
+	return -1;
+}
+
+/* Fire up the worker threads
+ */
+static int pool_start(struct buffer_s *buf, const struct rt_s *rt)
+{
+	struct pool_s *pool = &buf->pool;
+	char desc[64];
+
+	for(; pool->started < pool->num_workers; pool->started++)
+	{
+		if(rt_thread_create(&pool->threads[pool->started],
+			worker_proc, (void *)(buf),
+			rt_priority(rt, RT_WORKER + pool->started),
+			rt_cpu(rt, RT_WORKER + pool->started),
+			desc, sizeof(desc)))
+		{
+			fprintf(stderr, "Error creating worker thread.\n");
+			return -1;
+		}
+
+		fprintf(stderr, "Worker %u fired up%s.\n", pool->started, desc);
+	}
+
+	return 0;
+}
+
+/* Stop the workers and free the jobs, the reader has to be gone
+ */
+static void pool_stop(struct buffer_s *buf)
+{
+	struct pool_s *pool = &buf->pool;
+	unsigned int n;
+
+	state |= STATE_EXIT;
+	cb_futex_wake(&pool->submitted);
+
+	for(n = 0; n < pool->started; n++)
+		pthread_join(pool->threads[n], NULL);
+
+	pool->started = 0;
+
+	if(pool->jobs)
+	{
+		for(n = 0; n < pool->num_jobs; n++)
+		{
+			free(pool->jobs[n].raw);
+			free(pool->jobs[n].gain);
+			free(pool->jobs[n].step);
+		}
+	}
+
+	free(pool->jobs);
+	free(pool->threads);
+	pool->jobs = NULL;
+	pool->threads = NULL;
+}
+
+/* Wait for the reader to get ahead far enough to start TX. The
+ * device is configured in the meantime, so the sample rate is the
+ * actual one here.
+ */
+static int wait_watermark(struct devinfo_s *device)
+{
+	struct buffer_s *buf = device->buffers;
+	struct cb_s *cb = &buf->cb;
+	const unsigned int per_slot = buf->num_samples / buf->channels;
+	unsigned long long t = stats_now();
+	unsigned int want = buf->watermark, tmp_w, k;
+
+	if(buf->watermark_ms)
+		want = ((unsigned long long)buf->watermark * device->samplerate
+			/ 1000 + per_slot - 1) / per_slot;
+
+	if(!want || want > atomic_load_explicit(&cb->depth, memory_order_relaxed))
+		want = atomic_load_explicit(&cb->depth, memory_order_relaxed);
+
+	fprintf(stderr, "Waiting for %u of %u slots to fill up.\n",
+		want, cb->size);
+
+	/* The reader wakes us with every slot it publishes */
+	tmp_w = atomic_load_explicit(&cb->w, memory_order_acquire);
+
+	while(!state && ((tmp_w - cb_tail(cb, tmp_w, &k))
+		& (2 * cb->size - 1)) < want)
+	{
+		cb_wait(&cb->w, &cb->w_waiters, tmp_w);
+		tmp_w = atomic_load_explicit(&cb->w, memory_order_acquire);
+	}
+
+	if(state & STATE_EXIT)
+		return -1;
+
+	/* Short input, whatever made it in still goes out */
+	if(tmp_w == cb_tail(cb, tmp_w, &k))
+	{
+		fprintf(stderr, "No input.\n");
+		return -1;
+	}
+
+	fprintf(stderr, "Prebuffered %u slots in %.1fms.\n",
+		(tmp_w - cb_tail(cb, tmp_w, &k)) & (2 * cb->size - 1),
+		(stats_now() - t) * 1e-6);
+
+	return 0;
+}
+
+/* Allocate the device buffers and set up the sample stream
+ */
+static int setup_stream(struct devinfo_s *device, unsigned int num_buffers)
+{
+	struct buffer_s *buf = device->buffers;
+	unsigned int n;
+	int ret;
+
+	ret = bladerf_init_stream(&device->stream,
+		device->dev, stream_callback, &device->sbuf,
+		num_buffers,	BLADERF_FORMAT_SC16_Q12,
+		device->num_samples, buf->num_transfers,
+		device);
+	if(ret != 0)
+	{
+		fprintf(stderr, "Failed setting up stream: %s.\n",
+			bladerf_strerror(ret));
+		device->stream = NULL;
+		return ret;
+	}
+
+	/* Whatever an underrun repeats or sends, it must not be
+	 * uninitialized memory */
+	for(n = 0; n < num_buffers; n++)
+		memset(device->sbuf[n], 0,
+			device->num_samples * 2 * sizeof(int16_t));
+
+	return 0;
+}
+
+/* Tune every TX channel the device sends on
+ */
+static int tune(struct devinfo_s *device, unsigned int frequency)
+{
+	int ret;
+
+	ret = bladerf_set_frequency(device->dev, BLADERF_MODULE_TX, frequency);
+
+#ifdef HAVE_MIMO
+	/* The second channel tunes on its own */
+	if(ret == 0 && device->mimo)
+		ret = bladerf_set_frequency(device->dev, BLADERF_CHANNEL_TX(1),
+			frequency);
+#endif
+
+	if(ret == 0)
+		device->frequency = frequency;
+
+	return ret;
+}
+
+/* Set the device parameters
+ */
+static int setup_device(struct devinfo_s *device)
+{
+	int ret;
+
+	ret = bladerf_set_sample_rate(device->dev,
+		BLADERF_MODULE_TX, device->samplerate, &device->samplerate);
+	if(ret != 0)
+	{
+		fprintf(stderr, "Error setting sample rate to %u: %s.\n",
+			device->samplerate, bladerf_strerror(ret));
+		return ret;
+	}
+	else
+	{
+		fprintf(stderr, "Actual sample rate is %u.\n",
+			device->samplerate);
+	}
+
+	ret = tune(device, device->frequency);
+	if(ret != 0)
+	{
+		fprintf(stderr, "Error setting frequency to %uHz: %s.\n",
+			device->frequency, bladerf_strerror(ret));
+		return ret;
+	}
+	else
+	{
+		fprintf(stderr, "Frequency set to %uHz.\n", device->frequency);
+	}
+
+	ret = bladerf_set_txvga1(device->dev, device->txvga1);
+	if(ret != 0)
+	{
+		fprintf(stderr, "Error setting gain for txvga1: %s.\n",
+			bladerf_strerror(ret));
+		return ret;
+	}
+
+	ret = bladerf_set_txvga2(device->dev, device->txvga2);
+	if(ret != 0)
+	{
+		fprintf(stderr, "Error setting gain for txvga2: %s.\n",
+			bladerf_strerror(ret));
+		return ret;
+	}
+
+	ret = bladerf_set_bandwidth(device->dev,
+		BLADERF_MODULE_TX, device->bandwidth, &device->bandwidth);
+	if(ret != 0)
+	{
+		fprintf(stderr, "Error setting LPF bandwidth: %s.\n",
+			bladerf_strerror(ret));
+		return ret;
+	}
+	else
+	{
+		fprintf(stderr, "Bandwidth set to %uHz.\n", device->bandwidth);
+	}
+
+	return 0;
+}
+
+/* Switch TX on or off, both channels for MIMO
+ */
+static int tx_enable(struct devinfo_s *device, bool enable)
+{
+	int ret;
+
+	ret = bladerf_enable_module(device->dev, BLADERF_MODULE_TX, enable);
+
+#ifdef HAVE_MIMO
+	if(ret == 0 && device->mimo)
+		ret = bladerf_enable_module(device->dev, BLADERF_CHANNEL_TX(1),
+			enable);
+#endif
+
+	return ret;
+}
+
+/* Stream until the input or the user says stop
+ */
+static int tx_run(struct devinfo_s *device)
+{
+	int ret;
+
+	if(device->buffers->engine == ENGINE_SYNC)
+		return sync_run(device);
+
+	ret = bladerf_stream(device->stream, tx_layout(device));
+	if(ret != 0)
+		fprintf(stderr, "Failed starting stream: %s.\n",
+			bladerf_strerror(ret));
+
+	return ret;
+}
+
+/* Streaming thread of every device but the first, which streams
+ * from the main thread
+ */
+static void *device_proc(void *arg)
+{
+	struct devinfo_s *device = (struct devinfo_s *)(arg);
+
+	/* One device gone would stall the ring for all of them */
+	if(tx_run(device))
+		state |= STATE_EXIT;
+
+	pthread_exit(NULL);
+}
+
+/* Listen on the control socket, a stale one is replaced
+ */
+static int control_open(struct control_s *ctl)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	ctl->client = -1;
+	ctl->len = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(ctl->path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Control socket path is too long.\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, ctl->path);
+
+	if(!lstat(ctl->path, &st) && S_ISSOCK(st.st_mode))
+		unlink(ctl->path);
+
+	ctl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(ctl->fd < 0 || bind(ctl->fd, (struct sockaddr *)&addr, sizeof(addr))
+		|| listen(ctl->fd, 1))
+	{
+		fprintf(stderr, "Error opening control socket %s: %s\n",
+			ctl->path, strerror(errno));
+		if(ctl->fd >= 0)
+			close(ctl->fd);
+		ctl->fd = -1;
+		return -1;
+	}
+
+	fprintf(stderr, "Control socket is %s.\n", ctl->path);
+
+	return 0;
+}
+
+static void control_close(struct control_s *ctl)
+{
+	if(ctl->client >= 0)
+		close(ctl->client);
+	if(ctl->fd >= 0)
+	{
+		close(ctl->fd);
+		unlink(ctl->path);
+	}
+
+	ctl->client = -1;
+	ctl->fd = -1;
+}
+
+/* Run one command, the reply is one line
+ */
+static void control_command(struct control_s *ctl, char *line,
+		char *reply, size_t size)
+{
+	struct buffer_s *buf = ctl->buf;
+	char *save, *cmd, *arg, *which, *end;
+	unsigned int d, first = 0, last = ctl->num_devices;
+	long value;
+	float gain;
+	int ret = 0;
+
+	cmd = strtok_r(line, " \t\r", &save);
+	arg = strtok_r(NULL, " \t\r", &save);
+	which = strtok_r(NULL, " \t\r", &save);
+
+	if(!cmd)
+	{
+		*reply = '\0';
+		return;
+	}
+
+	if(!strcmp(cmd, "help"))
+	{
+		snprintf(reply, size, "ok freq <Hz> [device], txvga1 <dB> "
+			"[device], txvga2 <dB> [device], gain <soft gain>\n");
+		return;
+	}
+
+	if(!arg)
+		goto usage;
+
+	/* All devices, or the one given */
+	if(which)
+	{
+		first = (unsigned int)strtoul(which, &end, 10);
+		if(*end || first >= ctl->num_devices)
+		{
+			snprintf(reply, size, "error no device %s\n", which);
+			return;
+		}
+		last = first + 1;
+	}
+
+	if(!strcmp(cmd, "gain"))
+	{
+		gain = strtof(arg, &end);
+		if(*end || gain < 0.f)
+			goto usage;
+
+		/* Nothing is scaled there */
+		if(buf->loop || buf->passthrough)
+		{
+			snprintf(reply, size, "error the input is %s\n", buf->loop ?
+				"converted once in loop mode" : buf->gen.kind ?
+				"made at a fixed amplitude" : "passed through as is");
+			return;
+		}
+
+		/* Holds from the next slot on, over the gains of later
+		 * playlist entries as well */
+		memcpy(&d, &gain, sizeof(d));
+		atomic_store_explicit(&buf->gain_req, d, memory_order_relaxed);
+
+		fprintf(stderr, "Control: soft gain %f.\n", gain);
+		snprintf(reply, size, "ok\n");
+		return;
+	}
+
+	value = strtol(arg, &end, 10);
+	if(*end)
+		goto usage;
+
+	for(d = first; d < last && ret == 0; d++)
+	{
+		struct devinfo_s *device = &ctl->devices[d];
+
+		if(!strcmp(cmd, "freq") && value > 0)
+			ret = tune(device, (unsigned int)value);
+		else if(!strcmp(cmd, "txvga1"))
+		{
+			ret = bladerf_set_txvga1(device->dev, (int)value);
+			if(ret == 0)
+				device->txvga1 = (int)value;
+		}
+		else if(!strcmp(cmd, "txvga2"))
+		{
+			ret = bladerf_set_txvga2(device->dev, (int)value);
+			if(ret == 0)
+				device->txvga2 = (int)value;
+		}
+		else
+			goto usage;
+
+		if(ret == 0)
+			fprintf(stderr, "Control: %s %li on device \"%s\".\n",
+				cmd, value, device->device_id);
+	}
+
+	if(ret != 0)
+		snprintf(reply, size, "error %s\n", bladerf_strerror(ret));
+	else
+		snprintf(reply, size, "ok\n");
+
+	return;
+
+usage:
+	snprintf(reply, size, "error try help\n");
+}
+
+/* Take what the client sent, commands end with a newline
+ */
+static int control_read(struct control_s *ctl)
+{
+	char reply[CONTROL_LINE], *nl;
+	ssize_t n;
+
+	n = recv(ctl->client, &ctl->line[ctl->len],
+		sizeof(ctl->line) - 1 - ctl->len, 0);
+	if(n <= 0)
+		return -1;
+
+	ctl->len += n;
+	ctl->line[ctl->len] = '\0';
+
+	while((nl = strchr(ctl->line, '\n')))
+	{
+		*nl = '\0';
+		control_command(ctl, ctl->line, reply, sizeof(reply));
+
+		if(*reply && send(ctl->client, reply, strlen(reply),
+			MSG_NOSIGNAL) < 0)
+			return -1;
+
+		ctl->len -= nl + 1 - ctl->line;
+		memmove(ctl->line, nl + 1, ctl->len + 1);
+	}
+
+	/* A line that long is no command of ours */
+	if(ctl->len == sizeof(ctl->line) - 1)
+		return -1;
+
+	return 0;
+}
+
+/* Serve the control socket, one client at a time, a new one takes
+ * over. Retuning goes straight to libbladeRF, which has its own
+ * locking, a new soft gain is left for the reader.
+ */
+static void *control_proc(void *arg)
+{
+	struct control_s *ctl = (struct control_s *)(arg);
+	struct pollfd fds[2];
+	int fd;
+
+	while(!(state & STATE_EXIT))
+	{
+		fds[0].fd = ctl->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = ctl->client;
+		fds[1].events = POLLIN;
+
+		if(poll(fds, ctl->client >= 0 ? 2 : 1, CONTROL_TICK_MS) <= 0)
+			continue;
+
+		if(fds[0].revents & POLLIN)
+		{
+			fd = accept4(ctl->fd, NULL, NULL, SOCK_CLOEXEC);
+			if(fd >= 0)
+			{
+				if(ctl->client >= 0)
+					close(ctl->client);
+				ctl->client = fd;
+				ctl->len = 0;
+				continue;
+			}
+		}
+
+		if(ctl->client >= 0 && fds[1].revents && control_read(ctl))
+		{
+			close(ctl->client);
+			ctl->client = -1;
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+/* Initialization and stuff
+ */
+int main(int argc, char **argv)
+{
+	struct bladerf_devinfo *devs;
+	struct sigaction sigact;
+	struct devinfo_s conf, devices[MAX_DEVICES];
+	struct devinfo_s *device = &devices[0];
+	char *device_ids[MAX_DEVICES];
+	unsigned int num_devices = 0, d;
+	size_t mem[MEM_COUNT];
+	struct buffer_s buffers;
+	struct rt_s rt;
+	bool show_help = false, sized = false;
+	int n, ret = EXIT_SUCCESS, err;
+	int ch;
+	struct cb_s *cb;
+	struct buffer_s *buf;
+	pthread_t reader, stats;
+	bool reader_started = false, stats_started = false;
+	struct control_s control;
+	pthread_t control_thread;
+	bool control_started = false;
+	char desc[64];
+	char *end;
+
+
+	buf = &buffers;
+	cb = &buf->cb;
+
+	/* Set up default values, bandwidth and num_transfers
+	 * are automatically calculated later */
+	conf.device_id = NULL;
+	conf.frequency = DEFAULT_FREQUENCY;
+	conf.samplerate = DEFAULT_SAMPLERATE;
+	conf.bandwidth = 0;
+	conf.txvga1 = DEFAULT_TXVGA1;
+	conf.txvga2 = DEFAULT_TXVGA2;
+	conf.dev = NULL;
+	conf.stream = NULL;
+	conf.buffers = buf;
+	conf.index = 0;
+	conf.channel = -1;
+	conf.mimo = false;
+	conf.sbuf = NULL;
+	conf.spare = NULL;
+	conf.spare_pos = 0;
+	conf.pos = 0;
+	conf.h = 0;
+	conf.split = NULL;
+	conf.quiet_run = 0;
+	conf.gap = false;
+	conf.ts = 0;
+	conf.air_known = false;
+	conf.air_t = 0;
+	conf.air_ts = 0;
+	conf.clock.last = 0;
+	conf.clock.prev = 0;
+	conf.thread_started = false;
+
+	rt.priority = DEFAULT_PRIORITY;
+	rt.cpus = NULL;
+	rt.num_cpus = 0;
+	rt.lock = false;
+
+	control.path = NULL;
+	control.fd = -1;
+	control.client = -1;
+
+	buf->fname = strdup(DEFAULT_FILENAME);
+	buf->list.entries = NULL;
+	buf->list.num_entries = 0;
+	buf->list.cur = 0;
+	buf->list.next = NULL;
+	buf->list.gain_held = false;
+	buf->input = DEFAULT_INPUT;
+	buf->udp = false;
+	buf->uring_depth = DEFAULT_URING_DEPTH;
+	buf->net.depth = DEFAULT_JITTER;
+	buf->net.header = DEFAULT_NET_HEADER;
+	buf->agc.soft_gain = DEFAULT_GAIN;
+	buf->agc.target = DEFAULT_AGAIN;
+	buf->agc.attack = DEFAULT_ATTACK;
+	buf->agc.release = DEFAULT_RELEASE;
+	buf->agc.rms = false;
+	buf->num_buffers = DEFAULT_BUFFERS;
+	buf->num_samples = DEFAULT_SAMPLES;
+	buf->num_transfers = 0;
+	buf->channels = DEFAULT_CHANNELS;
+	buf->in_rate = DEFAULT_IN_RATE;
+	buf->resample = false;
+	buf->resampler.coefs = NULL;
+	buf->resampler.hist = NULL;
+	buf->resampler.block = NULL;
+	buf->dsp.freq = DEFAULT_FREQ_SHIFT;
+	buf->dsp.dc_i = 0.f;
+	buf->dsp.dc_q = 0.f;
+	buf->dsp.iq_gain = 1.f;
+	buf->dsp.iq_phase = 0.f;
+	buf->dsp.nco = NULL;
+	buf->index = 0;
+	buf->zero_copy = false;
+	buf->low_memory = false;
+	buf->loop = false;
+	buf->trace = false;
+	buf->image = NULL;
+	buf->format = DEFAULT_FORMAT;
+	buf->watermark = DEFAULT_WATERMARK;
+	buf->watermark_ms = false;
+	buf->pool.num_workers = DEFAULT_WORKERS;
+	buf->pool.jobs = NULL;
+	buf->pool.threads = NULL;
+	buf->pool.started = 0;
+	buf->stats_interval = DEFAULT_STATS;
+	buf->underrun = DEFAULT_UNDERRUN;
+	buf->engine = DEFAULT_ENGINE;
+	buf->tx_delay = DEFAULT_TX_DELAY;
+	buf->quiet = DEFAULT_QUIET;
+	buf->hangover = DEFAULT_HANGOVER;
+	buf->budget = DEFAULT_BUDGET;
+	buf->silence = NULL;
+
+	cb->size = DEFAULT_CB_SIZE;
+	cb->r_size = DEFAULT_READ_BLOCKSIZE;
+	cb->huge = DEFAULT_HUGE;
+	cb->numa_node = DEFAULT_NUMA_NODE;
+	cb->data_size = 0;
+	cb->r = NULL;
+	cb->num_r = 0;
+	cb->tail = 0;
+	atomic_init(&cb->w, 0);
+	atomic_init(&cb->r_waiters, 0);
+	atomic_init(&cb->w_waiters, 0);
+
+	/* Evaluate command line options */
+	while((ch = getopt(argc, argv, "hd:i:I:q:j:U:F:C:f:r:x:o:O:B:b:g:G:a:A:D:M:m:n:p:s:t:R:w:S:u:E:Y:Q:T:P:c:H:N:W:X:y:zLlke")) != -1)
+	{
+		switch(ch)
 		{
-			/* Now we need to calculate the sqrt */
-			s = sqrtf(s);
+			case 'd':
+				if(num_devices < MAX_DEVICES)
+					device_ids[num_devices++] = strdup(optarg);
+				else
+				{
+					fprintf(stderr, "At most %u devices.\n", MAX_DEVICES);
+					show_help = true;
+				}
+				break;
+			case 'i': free(buf->fname);
+				buf->fname = strdup(optarg);
+				break;
+			case 'I':
+				for(n = 0; n < sizeof(input_names) / sizeof(*input_names); n++)
+					if(!strcmp(optarg, input_names[n]))
+						break;
+
+				if(n < sizeof(input_names) / sizeof(*input_names))
+					buf->input = n;
+				else
+					show_help = true;
+				break;
+			case 'q': buf->uring_depth = (unsigned int)atoi(optarg); break;
+			case 'j': buf->net.depth = (unsigned int)atoi(optarg); break;
+			case 'U':
+				for(n = 0; n < NET_HEADER_COUNT; n++)
+					if(!strcmp(optarg, net_header_names[n]))
+						break;
+
+				if(n < NET_HEADER_COUNT)
+					buf->net.header = n;
+				else
+					show_help = true;
+				break;
+			case 'F':
+				for(n = 0; n < FORMAT_COUNT; n++)
+					if(!strcmp(optarg, formats[n].name))
+						break;
+
+				if(n < FORMAT_COUNT)
+					buf->format = n;
+				else
+					show_help = true;
+				break;
+			case 'C': buf->channels = (unsigned int)atoi(optarg); break;
+			case 'f': conf.frequency = (unsigned int)atoi(optarg); break;
+			case 'r': conf.samplerate = (unsigned int)atoi(optarg); break;
+			case 'x': buf->in_rate = (unsigned int)atoi(optarg); break;
+			case 'o': buf->dsp.freq = atoi(optarg); break;
+			case 'O':
+				if(sscanf(optarg, "%f,%f", &buf->dsp.dc_i,
+					&buf->dsp.dc_q) != 2)
+					show_help = true;
+				break;
+			case 'B':
+				if(sscanf(optarg, "%f,%f", &buf->dsp.iq_gain,
+					&buf->dsp.iq_phase) != 2)
+					show_help = true;
+				break;
+			case 'b': conf.bandwidth = (unsigned int)atoi(optarg); break;
+			case 'g': conf.txvga1 = atoi(optarg); break;
+			case 'G': conf.txvga2 = atoi(optarg); break;
+			case 'm': buf->agc.soft_gain = (float)atof(optarg); break;
+			case 'a': buf->agc.target = (float)atof(optarg); break;
+			case 'A': buf->agc.attack = (float)atof(optarg); break;
+			case 'D': buf->agc.release = (float)atof(optarg); break;
+			case 'M':
+				if(!strcmp(optarg, "rms"))
+					buf->agc.rms = true;
+				else if(!strcmp(optarg, "peak"))
+					buf->agc.rms = false;
+				else
+					show_help = true;
+				break;
+			case 'p': cb->size = (unsigned int)atoi(optarg);
+				sized = true;
+				break;
+			case 'W':
+				buf->watermark = (unsigned int)strtoul(optarg, &end, 10);
+				buf->watermark_ms = !strcmp(end, "ms");
+				if(end == optarg || (*end && !buf->watermark_ms))
+					show_help = true;
+				break;
+			case 'n': buf->num_buffers = (unsigned int)atoi(optarg);
+				sized = true;
+				break;
+			case 's': buf->num_samples = (unsigned int)atoi(optarg);
+				sized = true;
+				break;
+			case 't': buf->num_transfers = (unsigned int)atoi(optarg);
+				sized = true;
+				break;
+			case 'u':
+				for(n = 0; n < sizeof(underrun_names) / sizeof(*underrun_names); n++)
+					if(!strcmp(optarg, underrun_names[n]))
+						break;
+
+				if(n < sizeof(underrun_names) / sizeof(*underrun_names))
+					buf->underrun = n;
+				else
+					show_help = true;
+				break;
+			case 'E':
+				for(n = 0; n < sizeof(engine_names) / sizeof(*engine_names); n++)
+					if(!strcmp(optarg, engine_names[n]))
+						break;
+
+				if(n < sizeof(engine_names) / sizeof(*engine_names))
+					buf->engine = n;
+				else
+					show_help = true;
+				break;
+			case 'Y': buf->tx_delay = (unsigned int)atoi(optarg); break;
+			case 'Q': buf->quiet = (float)atof(optarg); break;
+			case 'T': buf->hangover = (unsigned int)atoi(optarg); break;
+			case 'y': buf->budget = (unsigned int)atoi(optarg); break;
+			case 'P': rt.priority = atoi(optarg); break;
+			case 'c':
+				if(rt_parse_cpus(&rt, optarg))
+					show_help = true;
+				break;
+			case 'k': rt.lock = true; break;
+			case 'X': free(control.path);
+				control.path = strdup(optarg);
+				break;
+			case 'H':
+				for(n = 0; n < sizeof(huge_names) / sizeof(*huge_names); n++)
+					if(!strcmp(optarg, huge_names[n]))
+						break;
 
-			/* Scale down current gain accordingly */
-			gain = again/s * gain;
-			
-			fprintf(stderr,
-				"WARNING: Soft gain adjusted to %f (%f).\n",
-				gain, s);
-			
-			/* Also correct current samples using the new gain */
-			i = i_in * gain;
-			q = q_in * gain;
+				if(n < sizeof(huge_names) / sizeof(*huge_names))
+					cb->huge = n;
+				else
+					show_help = true;
+				break;
+			case 'N':
+				cb->numa_node = strcmp(optarg, "auto") ?
+					atoi(optarg) : NUMA_AUTO;
+				break;
+			case 'R': cb->r_size = (unsigned int)atoi(optarg); break;
+			case 'w': buf->pool.num_workers = (unsigned int)atoi(optarg); break;
+			case 'S': buf->stats_interval = (unsigned int)atoi(optarg); break;
+			case 'z': buf->zero_copy = true; break;
+			case 'L': buf->low_memory = true; break;
+			case 'l': buf->loop = true; break;
+			case 'e': buf->trace = true; break;
+			case 'h':
+			default:
+				show_help = true;
 		}
+	}
+
+	/* Now calculate bandwidth and num_transfers if the user didn't
+	 * configure them manually */
+	if(!conf.bandwidth)
+		conf.bandwidth = conf.samplerate * 3 / 4;
+	if(!buf->num_transfers)
+		buf->num_transfers = buf->num_buffers / 2;
+
+	/* Everything is sized for the format and gain of the first
+	 * entry, the reader switches as the others come */
+	if(!strncmp(buf->fname, PLAYLIST_PREFIX, strlen(PLAYLIST_PREFIX)))
+	{
+		if(playlist_load(&buf->list, buf->fname + strlen(PLAYLIST_PREFIX),
+			buf->format, buf->agc.soft_gain))
+			return EXIT_FAILURE;
+
+		buf->format = buf->list.entries[0].format;
+		buf->agc.soft_gain = buf->list.entries[0].gain;
+	}
+
+	/* What the old design did in the callback, but the reader still
+	 * does the I/O: it converts right into the device buffers, the
+	 * ring is what the transfers need plus as much again at most,
+	 * the input comes in one block at a time */
+	if(buf->low_memory && buf->budget) {
+		fprintf(stderr, "Low memory mode and a latency budget both size "
+			"the buffers.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The budget would quietly replace them */
+	if(sized && buf->budget) {
+		fprintf(stderr, "A latency budget sizes the buffers, it doesn't go "
+			"with -s, -p, -n or -t.\n");
+		return EXIT_FAILURE;
+	}
+
+	if(buf->low_memory)
+	{
+		buf->zero_copy = true;
+		buf->pool.num_workers = 0;
+
+		for(cb->size = 2; cb->size <= buf->num_transfers; cb->size <<= 1);
+
+		if(cb->r_size > UNROLL_FACTOR * formats[buf->format].size)
+			cb->r_size = UNROLL_FACTOR * formats[buf->format].size;
+	}
+
+	if(buf->budget && budget_size(buf, conf.samplerate))
+		return EXIT_FAILURE;
+
+	agc_init(&buf->agc, conf.samplerate);
+	memcpy(&buf->gain_bits, &buf->agc.soft_gain, sizeof(buf->gain_bits));
+	atomic_init(&buf->gain_req, buf->gain_bits);
+
+	if(dsp_init(&buf->dsp, conf.samplerate))
+		return EXIT_FAILURE;
+
+	buf->kernel = kernel_select(buf->format);
+	buf->resample = buf->in_rate && buf->in_rate != conf.samplerate;
+	buf->passthrough = buf->format == FORMAT_Q12 && !buf->resample
+		&& !buf->dsp.stages && buf->agc.soft_gain == 1.f
+		&& buf->agc.target <= 0.f && !control.path
+		&& !buf->list.num_entries;
+
+	if(!num_devices)
+		device_ids[num_devices++] = strdup(DEFAULT_DEVICE_ID);
+
+	conf.device_id = device_ids[0];
+
+	if(!buf->num_samples || !cb->r_size) {
+		fprintf(stderr, "Buffer and block sizes must not be 0.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The ring pointers are masked, not wrapped */
+	if(!cb->size || (cb->size & (cb->size - 1))) {
+		fprintf(stderr, "Circular buffer size must be a power of 2.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The loop image is copied into the device buffers */
+	if(buf->zero_copy && buf->loop) {
+		fprintf(stderr, "Zero-copy and loop mode don't go together.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* In zero-copy mode up to num_transfers slots are owned by
+	 * libbladeRF, the reader needs some left to fill */
+	if(buf->zero_copy && cb->size <= buf->num_transfers) {
+		fprintf(stderr, "Circular buffer size must exceed the number of "
+			"transfers in zero-copy mode.\n");
+		return EXIT_FAILURE;
+	}
+
+	if(buf->channels < 1 || buf->channels > 2) {
+		fprintf(stderr, "Only 1 or 2 channels are supported.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Slots go back when the device is done with them, there is no
+	 * telling whose buffer they'd be with more than one */
+	if(buf->zero_copy && (num_devices > 1 || buf->channels > 1)) {
+		fprintf(stderr, "Zero-copy needs a single device and channel.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The image position would be everybody's */
+	if(buf->loop && num_devices > 1) {
+		fprintf(stderr, "Loop mode needs a single device.\n");
+		return EXIT_FAILURE;
+	}
 
-		/* Convert to int16 and write to output buffer */
-		i_i32 = (int32_t)(i * 2047.f);
-		q_i32 = (int32_t)(q * 2047.f);
+	/* The image goes out without slots */
+	if(buf->loop && buf->trace) {
+		fprintf(stderr, "Loop mode has no slots to trace.\n");
+		return EXIT_FAILURE;
+	}
 
-		out[m * 2] = (int16_t)(i_i32);
-		out[m * 2 + 1] = (int16_t)(q_i32);
+	/* The image is of one input */
+	if(buf->loop && buf->list.num_entries) {
+		fprintf(stderr, "Loop mode doesn't play a list.\n");
+		return EXIT_FAILURE;
 	}
-	
-	return gain;
-}
 
-/* Read, convert and scale input data
- */
-static void *reader_proc(void *arg)
-{
-	struct buffer_s *buf = (struct buffer_s *)(arg);
-	struct cb_s *cb = &buf->cb;
-	unsigned int tmp_r;
-	int16_t *ptr;
-	size_t nread;
-	unsigned int n;
-	const unsigned int n_blocks = sizeof(float) * 2
-		* buf->num_samples / cb->r_size;
+	/* With memory locked a mapping would be faulted in whole, by
+	 * the reader, between two entries */
+	if(buf->list.num_entries && (buf->input == INPUT_MMAP
+		|| buf->input == INPUT_POPULATE)) {
+		fprintf(stderr, "Playlist entries are read, not mapped.\n");
+		buf->input = INPUT_STREAM;
+	}
 
-	while(!state)
-	{
-		/* Get read pointer in a safe way */
-		pthread_mutex_lock(&cb->r_lock);
-		tmp_r = cb->r;
-		pthread_mutex_unlock(&cb->r_lock);
+	/* A UDP stream never ends */
+	if(buf->loop && net_kind(buf->fname) == NET_UDP) {
+		fprintf(stderr, "Loop mode needs an input that ends.\n");
+		return EXIT_FAILURE;
+	}
 
-		/* Check for overflow (full condition)
-		 * Wait until consumer signals a free slot */
-		if(cb->w == (tmp_r ^ cb->size))
-			pthread_cond_wait(&cb->f_cond, &cb->f_cond_lock);
+	if(!buf->net.depth || !buf->uring_depth) {
+		fprintf(stderr, "The jitter buffer and the read ahead need at "
+			"least one entry.\n");
+		return EXIT_FAILURE;
+	}
 
-		/* User wants to exit now */
-		if(state & STATE_EXIT)
-			break;
+	/* The filter and the NCO run over consecutive samples of one
+	 * channel */
+	if((buf->resample || buf->dsp.stages) && buf->channels > 1) {
+		fprintf(stderr, "Resampling and DSP need a single channel "
+			"input.\n");
+		return EXIT_FAILURE;
+	}
 
-		/* Read the (float) samples */
-		nread = fread(cb->fbuf, cb->r_size,
-			n_blocks, buf->file);
+	if(gen_parse(&buf->gen, buf->fname, conf.samplerate, buf->channels,
+		buf->agc.soft_gain))
+		return EXIT_FAILURE;
 
-		if(nread < n_blocks)
-			fprintf(stderr, "WARNING: Short read.\n");
-		
-		/* Check a few conditions */
-		if(feof(buf->file) || ferror(buf->file))
-		{
-			state |= STATE_FINISHED;
-			break;
-		}
-		
-		/* Get the current slot in the buffers */
-		ptr = &cb->data[buf->num_samples * 2 * (cb->w & (cb->size - 1))];
-	
-		/* Convert float -> int16 and auto gain control */
-		for(n = 0; n < buf->num_samples; n += UNROLL_FACTOR)
-		{
-			float *in_ptr = &cb->fbuf[2 * n];
-			int16_t *out_ptr = &ptr[2 * n];
-			
-			buf->gain = scale_and_autogain(
-				in_ptr,
-				out_ptr,
-				buf->gain,
-				buf->again);
+	/* Made in Q12 at the device rate, nothing is converted */
+	if(buf->gen.kind) {
+		if(buf->resample || buf->dsp.stages || buf->agc.target > 0.f) {
+			fprintf(stderr, "A generated signal isn't resampled, corrected "
+				"or auto gained.\n");
+			return EXIT_FAILURE;
 		}
-		
-		/* Advance write pointer in a safe way */
-		pthread_mutex_lock(&cb->w_lock);
-		cb->w = (cb->w + 1) & (2 * cb->size - 1);
-		pthread_mutex_unlock(&cb->w_lock);
 
-		/* Signal a full slot */
-		pthread_cond_signal(&cb->e_cond);
+		buf->passthrough = true;
+		buf->input = INPUT_STREAM;
 	}
 
-	pthread_exit(NULL);
-}
+#ifndef HAVE_MIMO
+	if(buf->channels > 1 && num_devices == 1) {
+		fprintf(stderr, "This libbladeRF can't do MIMO TX.\n");
+		return EXIT_FAILURE;
+	}
+#endif
 
-/* Initialization and stuff
- */
-int main(int argc, char **argv)
-{
-	struct bladerf_devinfo *devs;
-	struct sigaction sigact;
-	struct devinfo_s device;
-	bool show_help = false;
-	int n, ret = EXIT_SUCCESS;
-	int ch;
-	struct cb_s *cb;
-	struct buffer_s *buf;
-	pthread_t reader;
+	/* The last slot may already be refilled by the reader */
+	if(buf->zero_copy && buf->underrun == UNDERRUN_REPEAT) {
+		fprintf(stderr, "Repeating on underrun needs copy mode.\n");
+		return EXIT_FAILURE;
+	}
 
+	/* There are no device buffers to hand out with the sync API */
+	if(buf->engine == ENGINE_SYNC && buf->zero_copy) {
+		fprintf(stderr, "Zero-copy needs the async engine.\n");
+		return EXIT_FAILURE;
+	}
 
-	buf = &device.buffers;
-	cb = &buf->cb;
+	/* Bursts need metadata, which only the sync engine sends */
+	buf->quiet_level = buf->quiet > 0.f ? (int)(buf->quiet * Q12_SCALE) : 0;
+	buf->timestamps = buf->underrun == UNDERRUN_GATE || buf->tx_delay
+		|| buf->quiet > 0.f;
 
-	/* Set up default values, bandwidth and num_transfers
-	 * are automatically calculated later */
-	device.device_id = strdup(DEFAULT_DEVICE_ID);
-	device.frequency = DEFAULT_FREQUENCY;
-	device.samplerate = DEFAULT_SAMPLERATE;
-	device.bandwidth = 0;
-	device.txvga1 = DEFAULT_TXVGA1;
-	device.txvga2 = DEFAULT_TXVGA2;
+	if(buf->timestamps && buf->engine != ENGINE_SYNC) {
+		fprintf(stderr, "Gating, silence gating and scheduled bursts need "
+			"the sync engine.\n");
+		return EXIT_FAILURE;
+	}
 
-	buf->fname = strdup(DEFAULT_FILENAME);
-	buf->pos = 0;
-	buf->gain = DEFAULT_GAIN;
-	buf->again = DEFAULT_AGAIN;
-	buf->num_buffers = DEFAULT_BUFFERS;
-	buf->num_samples = DEFAULT_SAMPLES;
-	buf->num_transfers = 0;
+#ifndef HAVE_TX_META
+	if(buf->timestamps) {
+		fprintf(stderr, "This libbladeRF can't do timestamped TX.\n");
+		return EXIT_FAILURE;
+	}
+#endif
 
-	cb->size = DEFAULT_CB_SIZE;
-	cb->r_size = DEFAULT_READ_BLOCKSIZE;
-	cb->r = 0;
-	cb->w = 0;
-	pthread_mutex_init(&cb->r_lock, NULL);
-	pthread_mutex_init(&cb->w_lock, NULL);
-	pthread_mutex_init(&cb->e_cond_lock, NULL);
-	pthread_mutex_init(&cb->f_cond_lock, NULL);
-	pthread_cond_init(&cb->e_cond, NULL);
-	pthread_cond_init(&cb->f_cond, NULL);
+	if(rt.priority < 0
+		|| rt.priority > sched_get_priority_max(SCHED_FIFO)) {
+		fprintf(stderr, "Priority must be between 0 and %i.\n",
+			sched_get_priority_max(SCHED_FIFO));
+		return EXIT_FAILURE;
+	}
 
-	/* Evaluate command line options */
-	while((ch = getopt(argc, argv, "hd:i:f:r:b:g:G:a:m:n:p:s:t:R:")) != -1)
+	if(show_help)
 	{
-		switch(ch)
-		{
-			case 'd': free(device.device_id);
-				device.device_id = strdup(optarg);
-				break;
-			case 'i': free(buf->fname);
-				buf->fname = strdup(optarg);
-				break;
-			case 'f': device.frequency = (unsigned int)atoi(optarg); break;
-			case 'r': device.samplerate = (unsigned int)atoi(optarg); break;
-			case 'b': device.bandwidth = (unsigned int)atoi(optarg); break;
-			case 'g': device.txvga1 = atoi(optarg); break;
-			case 'G': device.txvga2 = atoi(optarg); break;
-			case 'm': buf->gain = (float)atof(optarg); break;
-			case 'a': buf->again = (float)atof(optarg); break;
-			case 'p': cb->size = (unsigned int)atoi(optarg); break;
-			case 'n': buf->num_buffers = (unsigned int)atoi(optarg); break;
-			case 's': buf->num_samples = (unsigned int)atoi(optarg); break;
-			case 't': buf->num_transfers = (unsigned int)atoi(optarg); break;
-			case 'R': cb->r_size = (unsigned int)atoi(optarg); break;
-			case 'h':
-			default:
-				show_help = true;
-		}
+		usage(argv[0], &conf, &rt, num_devices);
+		return EXIT_FAILURE;
 	}
 
-	/* Now calculate bandwidth and num_transfers if the user didn't
-	 * configure them manually */
-	if(!device.bandwidth)
-		device.bandwidth = device.samplerate * 3 / 4;
-	if(!buf->num_transfers)
-		buf->num_transfers = buf->num_buffers / 2;
+	fprintf(stderr, "Buffers take %zu bytes%s.\n",
+		memory_use(buf, num_devices, mem),
+		buf->loop ? ", plus the converted input" : "");
 
-	if(buf->num_samples % UNROLL_FACTOR) {
-		fprintf(stderr, "Number of samples per buffer must be a multiple of %u.\n",
-			UNROLL_FACTOR);
-		return EXIT_FAILURE;
+	/* What -p, -n and -t put between the input and the air, against
+	 * what the traced latencies can be held up to */
+	if(buf->trace)
+	{
+		fprintf(stderr, "A slot is %.2fms, the ring holds %.1fms, ",
+			buf->num_samples * 1e3 / conf.samplerate,
+			(buf->budget ? buf->depth_max : cb->size)
+				* (buf->num_samples * 1e3 / conf.samplerate));
+		if(!buf->zero_copy)
+			fprintf(stderr, "the device buffers %.1fms, ", buf->num_buffers
+				* (buf->num_samples * 1e3 / conf.samplerate));
+		fprintf(stderr, "%.1fms are in flight.\n", buf->num_transfers
+			* (buf->num_samples * 1e3 / conf.samplerate));
 	}
 
-	if(show_help)
+	/* A ring slot holds every channel, one device takes them all
+	 * (MIMO) or several share them out */
+	buf->num_samples *= buf->channels;
+
+	for(d = 0; d < num_devices; d++)
 	{
-		usage(argv[0], &device);
-		return EXIT_FAILURE;
+		devices[d] = conf;
+		devices[d].device_id = device_ids[d];
+		devices[d].index = d;
+		devices[d].mimo = buf->channels > 1 && num_devices == 1;
+		devices[d].channel = buf->channels > 1 && num_devices > 1 ?
+			(int)(d % buf->channels) : -1;
+		devices[d].num_samples = devices[d].channel >= 0 ?
+			buf->num_samples / buf->channels : buf->num_samples;
 	}
 	
 	argc -= optind;
 	argv += optind;
 
-	/* Open input file (if not '-') */
-	if(strncmp("-", buf->fname, 1))
+	if(buf->gen.kind ? gen_start(&buf->gen) : buf->list.num_entries ?
+		playlist_open(buf) : open_input(buf, buf->fname, NULL))
+		return EXIT_FAILURE;
+
+
+	/* Allocate the buffers, in zero-copy mode the slots are
+	 * set up along with the stream. A mapped input file needs
+	 * no float buffer. */
+	cb->data = NULL;
+	cb->fbuf = NULL;
+	cb->slots = malloc(cb->size * sizeof(void *));
+	atomic_init(&cb->depth, buf->budget ? buf->depth_max : cb->size);
+	cb->quiet = buf->quiet > 0.f && !buf->loop ? calloc(cb->size, 1) : NULL;
+	cb->stamps = buf->trace && !buf->loop ?
+		calloc(cb->size, sizeof(*cb->stamps)) : NULL;
+
+	/* One read position per device */
+	cb->num_r = num_devices;
+	if(posix_memalign((void **)&cb->r, CACHE_LINE,
+		num_devices * sizeof(*cb->r)))
 	{
-		buf->file = fopen(buf->fname, "r");
-		if(buf->file == NULL)
+		fprintf(stderr, "Error allocating the read positions.\n");
+		cb->r = NULL;
+		ret = EXIT_FAILURE;
+		goto out0;
+	}
+	for(d = 0; d < num_devices; d++)
+		atomic_init(&cb->r[d].pos, 0);
+
+	/* Room for one block of leftovers plus a full read */
+	cb->f_size = (size_t)UNROLL_FACTOR * input_size(buf) + cb->r_size;
+	cb->f_pos = 0;
+	cb->f_len = 0;
+
+	/* Workers have their own input buffers, loop mode needs none.
+	 * The resampler carries its history from one slot to the next,
+	 * so it runs in the reader, and so does a playlist, whose format
+	 * changes within a slot. */
+	if(buf->resample && buf->pool.num_workers)
+		fprintf(stderr, "Resampling in the reader, no conversion "
+			"workers.\n");
+	else if(buf->list.num_entries && buf->pool.num_workers)
+		fprintf(stderr, "Playing a list in the reader, no conversion "
+			"workers.\n");
+	if(buf->loop || buf->resample || buf->gen.kind || buf->list.num_entries)
+		buf->pool.num_workers = 0;
+
+	if(buf->resample)
+	{
+		if(resampler_init(&buf->resampler, buf->in_rate, conf.samplerate))
 		{
-			fprintf(stderr, "Error opening input file: %s\n", strerror(errno));
-			return EXIT_FAILURE;
+			ret = EXIT_FAILURE;
+			goto out0;
 		}
+
+		fprintf(stderr, "Resampling from %u to %u (%u/%u, %u taps per "
+			"branch).\n", buf->in_rate, conf.samplerate,
+			buf->resampler.up, buf->resampler.down, buf->resampler.taps);
 	}
-	else
-		buf->file = stdin;
 
+	if(!buf->map && !buf->passthrough && !buf->pool.num_workers)
+		cb->fbuf = malloc(cb->f_size);
+
+	if(buf->engine == ENGINE_SYNC)
+	{
+		buf->silence = calloc(buf->num_samples, 2 * sizeof(int16_t));
+
+		for(d = 0; d < num_devices; d++)
+			if(devices[d].channel >= 0)
+				devices[d].split = malloc(devices[d].num_samples
+					* 2 * sizeof(int16_t));
+	}
+
+	if(buf->pool.num_workers && pool_init(buf))
+	{
+		ret = EXIT_FAILURE;
+		goto out0;
+	}
+
+	if(buf->loop)
+	{
+		if(load_image(buf))
+		{
+			ret = EXIT_FAILURE;
+			goto out0;
+		}
+	}
+	else if(!buf->zero_copy)
+	{
+		if(ring_alloc(cb, (size_t)cb->size * buf->num_samples
+			* 2 * sizeof(int16_t)))
+		{
+			ret = EXIT_FAILURE;
+			goto out0;
+		}
+
+		for(n = 0; n < cb->size; n++)
+			cb->slots[n] = &cb->data[buf->num_samples * 2 * n];
 
-	/* Allocate the buffers */
-	cb->data = malloc(cb->size * buf->num_samples * 2 * sizeof(int16_t));
-	cb->fbuf = malloc(buf->num_samples * 2 * sizeof(float));
+		fprintf(stderr, "Circular buffer is %lukB (%s pages).\n",
+			(unsigned long)(cb->data_size >> 10), huge_names[cb->huge]);
 
+		ring_bind(cb, cb->numa_node);
+	}
+
+
+	if(buf->gen.kind == GEN_TONE)
+		fprintf(stderr, "Generating a tone at %.3fHz, %zu samples a "
+			"period.\n", buf->gen.freq, buf->gen.period);
+	else if(buf->gen.kind)
+		fprintf(stderr, "Generating %s%s.\n", gen_names[buf->gen.kind],
+			buf->gen.period ? ", made once" : "");
+	else if(buf->passthrough)
+		fprintf(stderr, "Input is passed through unconverted.\n");
+	else
+		fprintf(stderr, "Using %s conversion kernels for %s, %s.\n",
+			buf->kernel->name,
+			formats[buf->format].name,
+			buf->agc.target > 0.f ?
+				"gain ramps while the AGC moves" : "fixed gain");
+
+	if(buf->dsp.stages)
+		fprintf(stderr, "DSP chain:%s%s%s.\n",
+			buf->dsp.stages & DSP_DC ? " DC offset" : "",
+			buf->dsp.stages & DSP_IQ ? " IQ balance" : "",
+			buf->dsp.stages & DSP_NCO ? " frequency shift" : "");
 
 	/* Set up signal handler to enable clean shutdowns */
 	sigact.sa_handler = sighandler;
@@ -467,6 +4145,18 @@ int main(int argc, char **argv)
 	sigaction(SIGQUIT, &sigact, NULL);
 	sigaction(SIGPIPE, &sigact, NULL);
 
+	/* Asking for stats shouldn't break any read() or libusb wait */
+	sigact.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sigact, NULL);
+
+	stats_init(&buf->stats, &buf->stats_start);
+	buf->stats_last = buf->stats_start;
+
+	if(pthread_create(&stats, NULL, stats_proc, (void *)(buf)))
+		fprintf(stderr, "Error creating stats thread, no telemetry.\n");
+	else
+		stats_started = true;
+
 	/* Look for devices attached */
 	ret = bladerf_get_device_list(&devs);
 	if(ret < 1)
@@ -494,166 +4184,282 @@ int main(int argc, char **argv)
 	bladerf_free_device_list(devs);
 
 
-	/* Open a device by given device string
+	/* Open the devices by given device strings
 	 */
-	ret = bladerf_open(&device.dev, device.device_id);
-	if(ret != 0)
+	for(d = 0; d < num_devices; d++)
 	{
-		fprintf(stderr, "Error opening device %s: %s.\n",
-			device.device_id, bladerf_strerror(ret));
-		goto out0;
+		ret = bladerf_open(&devices[d].dev, devices[d].device_id);
+		if(ret != 0)
+		{
+			fprintf(stderr, "Error opening device %s: %s.\n",
+				devices[d].device_id, bladerf_strerror(ret));
+			devices[d].dev = NULL;
+			goto out1;
+		}
+		else
+		{
+			fprintf(stderr, "Device \"%s\" opened successfully%s.\n",
+				devices[d].device_id, devices[d].mimo ? ", MIMO" : "");
+		}
+
+		if(devices[d].channel >= 0)
+			fprintf(stderr, "Device \"%s\" sends channel %i.\n",
+				devices[d].device_id, devices[d].channel);
 	}
-	else
+
+	/* Nothing has touched the ring yet, so it's not too late */
+	if(cb->data && cb->numa_node == NUMA_AUTO)
 	{
-		fprintf(stderr, "Device \"%s\" opened successfully.\n",
-			device.device_id);
+		struct bladerf_devinfo info;
+
+		if(!bladerf_get_devinfo(device->dev, &info))
+		{
+			n = usb_numa_node(info.usb_bus);
+
+			if(n >= 0)
+				ring_bind(cb, n);
+			else
+				fprintf(stderr, "No NUMA node for USB bus %u.\n",
+					info.usb_bus);
+		}
 	}
 
-	
-	/* Fire up reader thread */
-	ret = pthread_create(&reader, NULL, reader_proc,
-		(void *)(buf));
-	if(ret)
+	/* The reader converts straight into the device buffers,
+	 * so they have to exist before it starts */
+	if(buf->zero_copy)
 	{
-		fprintf(stderr, "Error creating reader thread.\n");
-		goto out1;
+		ret = setup_stream(device, cb->size + buf->num_transfers);
+		if(ret != 0)
+			goto out1;
+
+		memcpy(cb->slots, device->sbuf, cb->size * sizeof(void *));
+		device->spare = &device->sbuf[cb->size];
 	}
-	else
+	
+	/* Loop mode streams from the image, no reader needed */
+	if(!buf->loop)
 	{
-		fprintf(stderr, "Reader thread fired up.\n");
-	}
+		if(buf->pool.num_workers && pool_start(buf, &rt))
+			goto out1;
 
-	fprintf(stderr, "Waiting for buffer to fill up.\n");
-
-	while(!state && (cb->w != (cb->r ^ cb->size)))
-		usleep(100000);
+		/* Fire up reader thread */
+		ret = rt_thread_create(&reader, reader_proc, (void *)(buf),
+			rt_priority(&rt, RT_READER),
+			rt_cpu(&rt, RT_READER), desc, sizeof(desc));
+		if(ret)
+		{
+			fprintf(stderr, "Error creating reader thread.\n");
+			goto out1;
+		}
+		else
+		{
+			reader_started = true;
+			fprintf(stderr, "Reader thread fired up%s.\n", desc);
+		}
 
-	if(state & (STATE_EXIT | STATE_FINISHED))
-		goto out1;
+	}
 
 
-	/* Set the device parameters */
-	ret = bladerf_set_sample_rate(device.dev,
-		BLADERF_MODULE_TX, device.samplerate, &device.samplerate);
-	if(ret != 0)
-	{
-		fprintf(stderr, "Error setting sample rate to %u: %s.\n",
-			device.samplerate, bladerf_strerror(ret));
-		goto out1;
-	}
-	else
+	/* Set the device parameters and the sample streams up, the
+	 * reader fills the ring meanwhile */
+	for(d = 0; d < num_devices; d++)
 	{
-		fprintf(stderr, "Actual sample rate is %u.\n",
-			device.samplerate);
-	}
+		ret = setup_device(&devices[d]);
+		if(ret != 0)
+			goto out1;
 
-	ret = bladerf_set_frequency(device.dev,
-		BLADERF_MODULE_TX, device.frequency);
-	if(ret != 0)
-	{
-		fprintf(stderr, "Error setting frequency to %uHz: %s.\n",
-			device.frequency, bladerf_strerror(ret));
-		goto out1;
-	}
-	else
-	{
-		fprintf(stderr, "Frequency set to %uHz.\n", device.frequency);
+		if(buf->engine == ENGINE_SYNC)
+		{
+			ret = setup_sync(&devices[d]);
+			if(ret != 0)
+				goto out1;
+		}
+		else if(!buf->zero_copy)
+		{
+			ret = setup_stream(&devices[d], buf->num_buffers);
+			if(ret != 0)
+				goto out1;
+		}
 	}
+	
 
-	ret = bladerf_set_txvga1(device.dev, device.txvga1);
-	if(ret != 0)
+	/* Retuning from here on */
+	if(control.path)
 	{
-		fprintf(stderr, "Error setting gain for txvga1: %s.\n",
-			bladerf_strerror(ret));
-		goto out1;
-	}
+		control.devices = devices;
+		control.num_devices = num_devices;
+		control.buf = buf;
 
-	ret = bladerf_set_txvga2(device.dev, device.txvga2);
-	if(ret != 0)
-	{
-		fprintf(stderr, "Error setting gain for txvga2: %s.\n",
-			bladerf_strerror(ret));
-		goto out1;
-	}
+		if(control_open(&control))
+			goto out1;
 
-	ret = bladerf_set_bandwidth(device.dev,
-		BLADERF_MODULE_TX, device.bandwidth, &device.bandwidth);
-	if(ret != 0)
-	{
-		fprintf(stderr, "Error setting LPF bandwidth: %s.\n",
-			bladerf_strerror(ret));
-		goto out1;
-	}
-	else
-	{
-		fprintf(stderr, "Bandwidth set to %uHz.\n", device.bandwidth);
+		if(pthread_create(&control_thread, NULL, control_proc, &control))
+		{
+			fprintf(stderr, "Error creating control thread.\n");
+			goto out1;
+		}
+
+		control_started = true;
 	}
 
-	/* Set up the sample stream */
-	ret = bladerf_init_stream(&device.stream,
-		device.dev, stream_callback, &buf->sbuf,
-		buf->num_buffers,	BLADERF_FORMAT_SC16_Q12,
-		buf->num_samples, buf->num_transfers,
-		buf);
-	if(ret != 0)
+	/* Loop mode has everything ready */
+	if(!buf->loop && wait_watermark(device))
 	{
-		fprintf(stderr, "Failed setting up stream: %s.\n",
-			bladerf_strerror(ret));
+		/* Being told to stop isn't a failure, no input is */
+		if(!(state & STATE_EXIT))
+			ret = EXIT_FAILURE;
 		goto out1;
 	}
-	
+
+	/* The streaming thread is this one, all buffers exist now */
+	rt_thread_self(&rt);
+
+	if(rt.lock)
+		rt_lock_memory(devices, num_devices);
 
 	/* Finally enable TX... */
-	ret = bladerf_enable_module(device.dev, BLADERF_MODULE_TX, true);
-	if(ret != 0)
+	for(d = 0; d < num_devices; d++)
 	{
-		fprintf(stderr, "Error enabling TX module: %s.\n",
-			bladerf_strerror(ret));
-		goto out1;
+		ret = tx_enable(&devices[d], true);
+		if(ret != 0)
+		{
+			fprintf(stderr, "Error enabling TX module: %s.\n",
+				bladerf_strerror(ret));
+			goto out1;
+		}
+		else
+		{
+			fprintf(stderr, "Successfully enabled TX module.\n");
+		}
 	}
-	else
+
+	/* ...start the streams of the other devices... */
+	for(d = 1; d < num_devices; d++)
 	{
-		fprintf(stderr, "Successfully enabled TX module.\n");
+		ret = rt_thread_create(&devices[d].thread, device_proc,
+			(void *)(&devices[d]), rt_priority(&rt, RT_STREAM),
+			rt_cpu(&rt, RT_WORKER + buf->pool.num_workers + d - 1),
+			desc, sizeof(desc));
+		if(ret)
+		{
+			fprintf(stderr, "Error creating streaming thread.\n");
+			goto out1;
+		}
+
+		devices[d].thread_started = true;
+		fprintf(stderr, "Streaming thread for device \"%s\" fired up%s.\n",
+			devices[d].device_id, desc);
 	}
 
-	/* ...and start the stream.
+	/* ...and our own one.
 	 * Execution stops here until stream has finished. */
-	ret = bladerf_stream(device.stream, BLADERF_MODULE_TX);
+	ret = tx_run(device);
 	if(ret != 0)
+		goto out1;
+
+	/* The others send what is left in the ring on their own */
+	for(d = 1; d < num_devices; d++)
 	{
-		fprintf(stderr, "Failed starting stream: %s.\n",
-			bladerf_strerror(ret));
-		goto out2;
+		if(devices[d].thread_started)
+			pthread_join(devices[d].thread, NULL);
+		devices[d].thread_started = false;
 	}
 
 	/* Cleanup the mess */
-out2:
-	bladerf_deinit_stream(device.stream);
-
 out1:
-	ret = bladerf_enable_module(device.dev, BLADERF_MODULE_TX, false);
-	if(ret != 0)
+	/* The reader may still be filling device buffers (zero-copy),
+	 * so it has to be gone before the stream is torn down */
+	if(reader_started)
 	{
-		fprintf(stderr, "Error disabling TX module: %s.\n",
-			bladerf_strerror(ret));
+		state |= STATE_EXIT;
+		for(d = 0; d < num_devices; d++)
+			cb_futex_wake(&cb->r[d].pos);
+		cb_futex_wake(&cb->w);
+
+		pthread_join(reader, NULL);
 	}
-	else
+
+	/* Whoever is still streaming stops now */
+	state |= STATE_EXIT;
+	cb_futex_wake(&cb->w);
+
+	for(d = 1; d < num_devices; d++)
+		if(devices[d].thread_started)
+			pthread_join(devices[d].thread, NULL);
+
+	/* Workers may write into device buffers just as well */
+	pool_stop(buf);
+
+	/* Nobody retunes what is about to close */
+	if(control_started)
+		pthread_join(control_thread, NULL);
+	control_close(&control);
+
+	if(stats_started)
 	{
-		fprintf(stderr, "Successfully disabled TX module.\n");
+		pthread_join(stats, NULL);
+		stats_report(stderr, &buf->stats, &buf->stats_last,
+			&buf->stats_start);
 	}
-	
-	bladerf_close(device.dev);
-	fprintf(stderr, "Device closed.\n");
-	
-	pthread_cond_signal(&cb->f_cond);
-	pthread_cond_signal(&cb->e_cond);
 
-	pthread_join(reader, NULL);
+	if(cb->stamps)
+		stats_histogram(stderr, &buf->stats);
+
+	for(d = 0; d < num_devices && devices[d].dev; d++)
+	{
+		if(devices[d].stream)
+			bladerf_deinit_stream(devices[d].stream);
+
+		/* Doesn't touch ret, how the run went is decided */
+		err = tx_enable(&devices[d], false);
+		if(err != 0)
+		{
+			fprintf(stderr, "Error disabling TX module: %s.\n",
+				bladerf_strerror(err));
+		}
+		else
+		{
+			fprintf(stderr, "Successfully disabled TX module.\n");
+		}
+		
+		bladerf_close(devices[d].dev);
+		fprintf(stderr, "Device \"%s\" closed.\n", devices[d].device_id);
+	}
 
 out0:
-	free(cb->data);
+	if(buf->pool.jobs)
+		pool_stop(buf);
+
+	if(buf->map)
+		munmap((void *)buf->map, buf->map_size);
+
+	if(buf->udp)
+		net_udp_close(&buf->net);
+	if(buf->input == INPUT_URING)
+		uring_close(&buf->uring);
+
+	free(buf->image);
+	gen_free(&buf->gen);
+	playlist_free(&buf->list);
+	free(cb->slots);
+	free(cb->quiet);
+	free(cb->stamps);
+	free(cb->r);
+	if(cb->data)
+		munmap(cb->data, cb->data_size);
 	free(cb->fbuf);
+	free(buf->silence);
+	free(rt.cpus);
+	free(control.path);
+	resampler_free(&buf->resampler);
+	dsp_free(&buf->dsp);
 
-	return ret;
-}
+	for(d = 0; d < num_devices; d++)
+	{
+		free(devices[d].split);
+		free(device_ids[d]);
+	}
 
+	/* Errors from libbladeRF are negative */
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "net.h"
+
+/* Ask for this much socket buffer, bursts land there while the
+ * reader converts */
+#define NET_RCVBUF			(8 << 20)
+
+
+int net_kind(const char *name)
+{
+	if(!strncmp(name, "udp://", 6))
+		return NET_UDP;
+	if(!strncmp(name, "tcp://", 6))
+		return NET_TCP;
+
+	return NET_NONE;
+}
+
+/* Take scheme://host:port apart, host may be empty or [v6] */
+static int net_split(const char *name, char *host, size_t host_size,
+		char *port, size_t port_size)
+{
+	const char *p = strstr(name, "://") + 3;
+	const char *colon;
+	size_t len;
+
+	if(*p == '[')
+	{
+		colon = strchr(p, ']');
+		if(!colon || colon[1] != ':')
+			goto error;
+
+		p++;
+		len = colon - p;
+		colon++;
+	}
+	else
+	{
+		colon = strrchr(p, ':');
+		if(!colon)
+			goto error;
+
+		len = colon - p;
+	}
+
+	if(len >= host_size || !colon[1] || strlen(colon + 1) >= port_size)
+		goto error;
+
+	memcpy(host, p, len);
+	host[len] = '\0';
+	strcpy(port, colon + 1);
+
+	return 0;
+
+error:
+	fprintf(stderr, "Can't make sense of %s, it's "
+		"scheme://host:port or scheme://:port.\n", name);
+	return -1;
+}
+
+static struct addrinfo *net_resolve(const char *name, int type)
+{
+	struct addrinfo hints, *ai;
+	char host[256], port[32];
+	int ret;
+
+	if(net_split(name, host, sizeof(host), port, sizeof(port)))
+		return NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = host[0] ? 0 : AI_PASSIVE;
+
+	ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &ai);
+	if(ret)
+	{
+		fprintf(stderr, "Error resolving %s: %s\n", name, gai_strerror(ret));
+		return NULL;
+	}
+
+	return ai;
+}
+
+/* Bigger socket buffer, and say so if the system limits it */
+static void net_rcvbuf(int fd)
+{
+	int size = NET_RCVBUF;
+	socklen_t len = sizeof(size);
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	/* Linux reports twice what it counts against the limit */
+	if(!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len)
+		&& size / 2 < NET_RCVBUF)
+		fprintf(stderr, "Socket receive buffer is %ikB, raise "
+			"net.core.rmem_max for more.\n", size / 2 >> 10);
+}
+
+static void net_peer(const struct sockaddr *sa, socklen_t len,
+		const char *what)
+{
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+
+	if(!getnameinfo(sa, len, host, sizeof(host), port, sizeof(port),
+		NI_NUMERICHOST | NI_NUMERICSERV))
+		fprintf(stderr, "%s %s port %s.\n", what, host, port);
+}
+
+int net_tcp(const char *name)
+{
+	struct addrinfo *ai, *a;
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+	int fd = -1, conn, on = 1;
+
+	ai = net_resolve(name, SOCK_STREAM);
+	if(!ai)
+		return -1;
+
+	for(a = ai; a; a = a->ai_next)
+	{
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd < 0)
+			continue;
+
+		/* Somebody else's server, or ours for them to connect to */
+		if(!(a->ai_flags & AI_PASSIVE) && !connect(fd, a->ai_addr,
+			a->ai_addrlen))
+		{
+			net_peer(a->ai_addr, a->ai_addrlen, "Connected to");
+			break;
+		}
+
+		if(a->ai_flags & AI_PASSIVE)
+		{
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+			if(!bind(fd, a->ai_addr, a->ai_addrlen) && !listen(fd, 1))
+			{
+				net_peer(a->ai_addr, a->ai_addrlen,
+					"Waiting for a connection on");
+
+				conn = accept(fd, (struct sockaddr *)&peer, &peer_len);
+				close(fd);
+				fd = conn;
+
+				if(fd >= 0)
+				{
+					net_peer((struct sockaddr *)&peer, peer_len,
+						"Connection from");
+					break;
+				}
+			}
+		}
+
+		if(fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai);
+
+	if(fd < 0)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	net_rcvbuf(fd);
+
+	return fd;
+}
+
+/* Join if it's a multicast group we are bound to */
+static int net_join(int fd, const struct addrinfo *a)
+{
+	if(a->ai_family == AF_INET)
+	{
+		const struct sockaddr_in *sin =
+			(const struct sockaddr_in *)a->ai_addr;
+		struct ip_mreq mreq;
+
+		if(!IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+			return 0;
+
+		mreq.imr_multiaddr = sin->sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+		return setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			&mreq, sizeof(mreq));
+	}
+
+	if(a->ai_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *)a->ai_addr;
+		struct ipv6_mreq mreq;
+
+		if(!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+			return 0;
+
+		mreq.ipv6mr_multiaddr = sin6->sin6_addr;
+		mreq.ipv6mr_interface = 0;
+
+		return setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+			&mreq, sizeof(mreq));
+	}
+
+	return 0;
+}
+
+int net_udp_open(struct net_s *net, const char *name, struct stats_s *stats)
+{
+	const struct timeval timeout = { 0, NET_TIMEOUT_MS * 1000 };
+	struct addrinfo *ai, *a;
+	unsigned int n;
+	int on = 1;
+
+	net->fd = -1;
+	net->pool = NULL;
+	net->pool_data = NULL;
+	net->free = NULL;
+	net->window = NULL;
+	net->queue = NULL;
+	net->stats = stats;
+
+	ai = net_resolve(name, SOCK_DGRAM);
+	if(!ai)
+		return -1;
+
+	for(a = ai; a; a = a->ai_next)
+	{
+		net->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(net->fd < 0)
+			continue;
+
+		/* More than one of us may listen to a group */
+		setsockopt(net->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if(!bind(net->fd, a->ai_addr, a->ai_addrlen)
+			&& !net_join(net->fd, a))
+		{
+			net_peer(a->ai_addr, a->ai_addrlen, "Receiving on");
+			break;
+		}
+
+		close(net->fd);
+		net->fd = -1;
+	}
+
+	freeaddrinfo(ai);
+
+	if(net->fd < 0)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	net_rcvbuf(net->fd);
+
+	/* Wake up every so often, for the gaps and to see if we should
+	 * stop */
+	setsockopt(net->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	/* The window can't hold more than depth packets and one batch
+	 * comes in at a time, everything in between is queued */
+	n = net->depth + NET_BATCH;
+	net->pool = malloc(n * sizeof(*net->pool));
+	net->pool_data = malloc((size_t)n * NET_MAX_PACKET);
+	net->free = malloc(n * sizeof(*net->free));
+	net->window = malloc(net->depth * sizeof(*net->window));
+	net->queue_size = 2 * n + 1;
+	net->queue = malloc(net->queue_size * sizeof(*net->queue));
+
+	if(!net->pool || !net->pool_data || !net->free || !net->window
+		|| !net->queue)
+	{
+		fprintf(stderr, "Error allocating the jitter buffer.\n");
+		return -1;
+	}
+
+	for(net->num_free = 0; net->num_free < n; net->num_free++)
+		net->free[net->num_free] = net->num_free;
+
+	for(n = 0; n < net->depth; n++)
+		net->window[n] = -1;
+
+	net->held = 0;
+	net->next = 0;
+	net->top = 0;
+	net->synced = false;
+	net->gap_len = 0;
+	net->queue_head = 0;
+	net->queue_len = 0;
+	net->cur.packet = -1;
+	net->cur.len = 0;
+	net->cur_pos = 0;
+
+	fprintf(stderr, "Jitter buffer of %u packets (%lukB).\n",
+		net->depth,
+		(unsigned long)(((size_t)net->depth + NET_BATCH)
+			* NET_MAX_PACKET) >> 10);
+
+	return 0;
+}
+
+static void net_release(struct net_s *net, int packet)
+{
+	net->free[net->num_free++] = packet;
+}
+
+/* Queue a packet, or a gap of silence: those run together */
+static void net_emit(struct net_s *net, int packet, size_t len)
+{
+	struct net_out_s *last = net->queue_len ? &net->queue[(net->queue_head
+		+ net->queue_len - 1) % net->queue_size] : NULL;
+
+	if(packet < 0 && last && last->packet < 0)
+	{
+		last->len += len;
+		return;
+	}
+
+	last = &net->queue[(net->queue_head + net->queue_len++)
+		% net->queue_size];
+	last->packet = packet;
+	last->len = packet < 0 ? len : net->pool[packet].len;
+}
+
+/* Move the window on by one, whatever isn't there is lost */
+static void net_advance(struct net_s *net)
+{
+	int *slot = &net->window[net->next % net->depth];
+
+	if(*slot >= 0)
+	{
+		net_emit(net, *slot, 0);
+		*slot = -1;
+		net->held--;
+	}
+	else
+	{
+		net_emit(net, -1, net->gap_len);
+		stats_add(&net->stats->net_lost, 1);
+	}
+
+	net->next++;
+}
+
+/* Everything held goes out, no more waiting for the gaps */
+static void net_flush(struct net_s *net)
+{
+	while(net->held)
+		net_advance(net);
+}
+
+/* Put a datagram where it belongs
+ */
+static void net_packet(struct net_s *net, int packet, size_t len)
+{
+	struct net_packet_s *p = &net->pool[packet];
+	char *base = net->pool_data + (size_t)packet * NET_MAX_PACKET;
+	uint64_t seq;
+	int *slot;
+
+	stats_add(&net->stats->net_packets, 1);
+
+	if(net->header == NET_HEADER_NONE)
+	{
+		p->data = base;
+		p->len = len;
+		net_emit(net, packet, 0);
+		return;
+	}
+
+	if(len < sizeof(seq))
+	{
+		net_release(net, packet);
+		return;
+	}
+
+	memcpy(&seq, base, sizeof(seq));
+	p->seq = seq = le64toh(seq);
+	p->data = base + sizeof(seq);
+	p->len = len - sizeof(seq);
+
+	/* Too far off either way to be the same stream, the sender
+	 * started over */
+	if(net->synced && (seq < net->next ? net->next - seq :
+		seq - net->next) >= (uint64_t)NET_RESYNC * net->depth)
+	{
+		fprintf(stderr, "Sequence number jumped from %llu to %llu, "
+			"starting over.\n",
+			(unsigned long long)net->next, (unsigned long long)seq);
+		net_flush(net);
+		net->synced = false;
+	}
+
+	if(!net->synced)
+	{
+		net->next = seq;
+		net->top = seq;
+		net->synced = true;
+	}
+
+	/* Already went out, or as a gap */
+	if(seq < net->next)
+	{
+		stats_add(&net->stats->net_late, 1);
+		net_release(net, packet);
+		return;
+	}
+
+	/* Make room for it */
+	while(seq >= net->next + net->depth)
+		net_advance(net);
+
+	slot = &net->window[seq % net->depth];
+	if(*slot >= 0)
+	{
+		stats_add(&net->stats->net_late, 1);
+		net_release(net, packet);
+		return;
+	}
+
+	*slot = packet;
+	net->held++;
+	net->gap_len = p->len;
+
+	/* Filled a hole behind the newest */
+	if(seq + 1 < net->top)
+		stats_add(&net->stats->net_reordered, 1);
+	else
+		net->top = seq + 1;
+
+	/* Whatever is complete from the front goes out */
+	while(net->window[net->next % net->depth] >= 0)
+		net_advance(net);
+}
+
+/* One batch, the first datagram is waited for up to NET_TIMEOUT_MS
+ * and the rest is what's there already
+ */
+static int net_receive(struct net_s *net)
+{
+	struct mmsghdr msgs[NET_BATCH];
+	struct iovec iov[NET_BATCH];
+	int packets[NET_BATCH];
+	int ret, m;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for(m = 0; m < NET_BATCH; m++)
+	{
+		packets[m] = net->free[--net->num_free];
+		iov[m].iov_base = net->pool_data
+			+ (size_t)packets[m] * NET_MAX_PACKET;
+		iov[m].iov_len = NET_MAX_PACKET;
+		msgs[m].msg_hdr.msg_iov = &iov[m];
+		msgs[m].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(net->fd, msgs, NET_BATCH, MSG_WAITFORONE, NULL);
+
+	for(m = 0; m < ret; m++)
+		net_packet(net, packets[m], msgs[m].msg_len);
+
+	/* Back with what wasn't used, in the order they came */
+	for(m = NET_BATCH - 1; m >= (ret > 0 ? ret : 0); m--)
+		net_release(net, packets[m]);
+
+	return ret;
+}
+
+ssize_t net_udp_read(struct net_s *net, void *ptr, size_t len)
+{
+	char *out = ptr;
+	size_t have = 0, n;
+
+	while(have < len)
+	{
+		/* The rest of what goes out right now */
+		if(net->cur_pos < net->cur.len)
+		{
+			n = net->cur.len - net->cur_pos;
+			if(n > len - have)
+				n = len - have;
+
+			if(net->cur.packet >= 0)
+				memcpy(&out[have],
+					net->pool[net->cur.packet].data + net->cur_pos, n);
+			else
+				memset(&out[have], net->fill, n);
+
+			net->cur_pos += n;
+			have += n;
+			continue;
+		}
+
+		if(net->cur.packet >= 0)
+		{
+			net_release(net, net->cur.packet);
+			net->cur.packet = -1;
+		}
+
+		if(net->queue_len)
+		{
+			net->cur = net->queue[net->queue_head];
+			net->queue_head = (net->queue_head + 1) % net->queue_size;
+			net->queue_len--;
+			net->cur_pos = 0;
+			continue;
+		}
+
+		/* What we have now goes out rather than waiting for more */
+		if(have)
+			break;
+
+		if(net_receive(net) < 0)
+		{
+			/* Nothing for a while, so the gaps won't fill any more */
+			if((errno == EAGAIN || errno == EWOULDBLOCK) && net->held)
+			{
+				net_flush(net);
+				continue;
+			}
+
+			if(errno == EWOULDBLOCK)
+				errno = EAGAIN;
+
+			return -1;
+		}
+	}
+
+	return have;
+}
+
+void net_udp_close(struct net_s *net)
+{
+	if(net->fd >= 0)
+	{
+		fprintf(stderr, "Network input: %llu packets, %llu lost, "
+			"%llu late, %llu reordered.\n",
+			atomic_load(&net->stats->net_packets),
+			atomic_load(&net->stats->net_lost),
+			atomic_load(&net->stats->net_late),
+			atomic_load(&net->stats->net_reordered));
+
+		close(net->fd);
+	}
+
+	free(net->pool);
+	free(net->pool_data);
+	free(net->free);
+	free(net->window);
+	free(net->queue);
+
+	net->fd = -1;
+	net->pool = NULL;
+	net->pool_data = NULL;
+	net->free = NULL;
+	net->window = NULL;
+	net->queue = NULL;
+}
@@ -0,0 +1,104 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "stats.h"
+
+
+/* Largest datagram, anything UDP can carry */
+#define NET_MAX_PACKET		65536
+
+/* Datagrams per recvmmsg() */
+#define NET_BATCH			32
+
+/* How long a receive waits before packets held back for a gap go
+ * out anyway, and the caller gets to check if it should stop */
+#define NET_TIMEOUT_MS		20
+
+/* A sequence number this far off is a restart of the sender, not
+ * loss or reordering, in jitter buffer lengths */
+#define NET_RESYNC			16
+
+/* What comes in front of the samples in every datagram */
+#define NET_HEADER_NONE		0	/* Nothing, taken in arrival order */
+#define NET_HEADER_SEQ		1	/* 64 bit little endian sequence number */
+#define NET_HEADER_COUNT	2
+
+/* Input URLs */
+#define NET_NONE			0	/* Not a URL, a file */
+#define NET_UDP				1
+#define NET_TCP				2
+
+/* A datagram in the pool
+ */
+struct net_packet_s
+{
+	char *data;					/* Samples, after the header */
+	size_t len;
+	uint64_t seq;
+};
+
+/* What goes out next, in order: a packet or a gap of silence
+ */
+struct net_out_s
+{
+	int packet;					/* Index into the pool, -1 for a gap */
+	size_t len;					/* Bytes of silence for a gap */
+};
+
+/* UDP receiver with a jitter buffer
+ * Datagrams are received in batches into a pool, put in order by
+ * their sequence numbers in a window of depth packets and handed out
+ * as one byte stream. Missing packets go out as silence once the
+ * window has moved past them or nothing came in for a while, those
+ * that show up after that are dropped.
+ */
+struct net_s
+{
+	int fd;
+	unsigned int header;		/* NET_HEADER_* */
+	unsigned int depth;			/* Jitter buffer length in packets */
+	unsigned char fill;			/* Byte value of silence */
+
+	struct net_packet_s *pool;	/* depth + NET_BATCH packets */
+	char *pool_data;
+	int *free;					/* Stack of unused packets */
+	unsigned int num_free;
+
+	int *window;				/* Packet by sequence number % depth */
+	unsigned int held;			/* Packets in the window */
+	uint64_t next;				/* Sequence number that goes out next */
+	uint64_t top;				/* One past the highest seen */
+	bool synced;				/* next is known */
+	size_t gap_len;				/* Silence for a lost packet */
+
+	struct net_out_s *queue;	/* Ready to go out */
+	unsigned int queue_size;
+	unsigned int queue_head;
+	unsigned int queue_len;
+
+	struct net_out_s cur;		/* Going out right now */
+	size_t cur_pos;
+
+	struct stats_s *stats;		/* Packet counters go here */
+};
+
+/* Which kind of input name is, NET_NONE for a file */
+int net_kind(const char *name);
+
+/* Connect to tcp://host:port, or listen on tcp://:port and take the
+ * first connection, returns the socket or -1 */
+int net_tcp(const char *name);
+
+/* Bind to udp://[host]:port, host may be a multicast group to join.
+ * header, depth and fill must be set already. */
+int net_udp_open(struct net_s *net, const char *name, struct stats_s *stats);
+
+/* Like read(), -1 with EAGAIN if nothing came in for NET_TIMEOUT_MS */
+ssize_t net_udp_read(struct net_s *net, void *ptr, size_t len);
+
+void net_udp_close(struct net_s *net);
+
+#endif
@@ -0,0 +1,200 @@
+#include <limits.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+
+static void hist_init(struct stats_hist_s *h)
+{
+	unsigned int n;
+
+	for(n = 0; n < STATS_HIST_BINS; n++)
+		atomic_init(&h->bins[n], 0);
+
+	atomic_init(&h->count, 0);
+	atomic_init(&h->max_ns, 0);
+}
+
+/* Upper end of a bin in us */
+static double hist_bound(unsigned int bin)
+{
+	unsigned int o = bin / STATS_HIST_SUB;
+	unsigned int sub = bin % STATS_HIST_SUB;
+
+	return (double)(STATS_HIST_SUB + sub + 1) * (1ULL << o) / STATS_HIST_SUB;
+}
+
+/* Where the fraction p of all slots is below, to a bin */
+static double hist_percentile(struct stats_hist_s *h, double p)
+{
+	unsigned long long count = atomic_load_explicit(&h->count,
+		memory_order_relaxed);
+	double max = atomic_load_explicit(&h->max_ns, memory_order_relaxed) * 1e-3;
+	unsigned long long sum = 0;
+	unsigned int n;
+
+	for(n = 0; n < STATS_HIST_BINS - 1; n++)
+	{
+		sum += atomic_load_explicit(&h->bins[n], memory_order_relaxed);
+		if(sum >= p * count)
+			break;
+	}
+
+	/* The top bin goes past what was seen */
+	return hist_bound(n) < max ? hist_bound(n) : max;
+}
+
+void stats_init(struct stats_s *s, struct stats_snap_s *snap)
+{
+	atomic_init(&s->converted, 0);
+	atomic_init(&s->convert_ns, 0);
+	atomic_init(&s->read_ns, 0);
+	atomic_init(&s->full_waits, 0);
+	atomic_init(&s->full_ns, 0);
+	atomic_init(&s->net_packets, 0);
+	atomic_init(&s->net_lost, 0);
+	atomic_init(&s->net_late, 0);
+	atomic_init(&s->net_reordered, 0);
+	atomic_init(&s->slots, 0);
+	atomic_init(&s->gated, 0);
+	atomic_init(&s->underruns, 0);
+	atomic_init(&s->fill_sum, 0);
+	atomic_init(&s->fill_count, 0);
+	atomic_init(&s->fill_min, ULLONG_MAX);
+	atomic_init(&s->fill_max, 0);
+	atomic_init(&s->cb_sum_ns, 0);
+	atomic_init(&s->cb_jitter_ns, 0);
+	atomic_init(&s->cb_count, 0);
+	atomic_init(&s->cb_min_ns, ULLONG_MAX);
+	atomic_init(&s->cb_max_ns, 0);
+	hist_init(&s->handoff);
+	hist_init(&s->air);
+
+	snap->t = stats_now();
+	snap->converted = 0;
+	snap->slots = 0;
+	snap->fill_sum = 0;
+	snap->fill_count = 0;
+	snap->cb_sum_ns = 0;
+	snap->cb_jitter_ns = 0;
+	snap->cb_count = 0;
+}
+
+void stats_report(FILE *f, struct stats_s *s, struct stats_snap_s *snap,
+		const struct stats_snap_s *start)
+{
+	struct stats_snap_s now;
+	struct rusage ru;
+	unsigned long long fill_min, fill_max;
+	unsigned long long cb_min, cb_max;
+	double dt, fills, cbs, cb_avg = 0., cb_jitter = 0.;
+
+	now.t = stats_now();
+	now.converted = atomic_load_explicit(&s->converted, memory_order_relaxed);
+	now.slots = atomic_load_explicit(&s->slots, memory_order_relaxed);
+	now.fill_sum = atomic_load_explicit(&s->fill_sum, memory_order_relaxed);
+	now.fill_count = atomic_load_explicit(&s->fill_count,
+		memory_order_relaxed);
+	now.cb_sum_ns = atomic_load_explicit(&s->cb_sum_ns, memory_order_relaxed);
+	now.cb_jitter_ns = atomic_load_explicit(&s->cb_jitter_ns,
+		memory_order_relaxed);
+	now.cb_count = atomic_load_explicit(&s->cb_count, memory_order_relaxed);
+
+	/* Start the next interval, a racing update just counts there */
+	fill_min = atomic_exchange(&s->fill_min, ULLONG_MAX);
+	fill_max = atomic_exchange(&s->fill_max, 0);
+	cb_min = atomic_exchange(&s->cb_min_ns, ULLONG_MAX);
+	cb_max = atomic_exchange(&s->cb_max_ns, 0);
+
+	/* CPU time of the whole process, to compare setups by */
+	getrusage(RUSAGE_SELF, &ru);
+
+	dt = (now.t - snap->t) * 1e-9;
+	fills = now.fill_count - snap->fill_count;
+	cbs = now.cb_count - snap->cb_count;
+
+	if(fill_min == ULLONG_MAX)
+		fill_min = 0;
+	if(cb_min == ULLONG_MAX)
+		cb_min = 0;
+
+	/* Jitter is the mean change from one interval to the next */
+	if(cbs > 0.)
+	{
+		cb_avg = (now.cb_sum_ns - snap->cb_sum_ns) * 1e-3 / cbs;
+		cb_jitter = (now.cb_jitter_ns - snap->cb_jitter_ns) * 1e-3 / cbs;
+	}
+
+	fprintf(f, "stats: time=%.3f interval=%.3f converted=%llu slots=%llu "
+		"gated=%llu underruns=%llu sample_rate=%.0f fill_min=%llu "
+		"fill_avg=%.1f fill_max=%llu read_ms=%.1f convert_ms=%.1f "
+		"full_waits=%llu full_ms=%.1f net_packets=%llu net_lost=%llu "
+		"net_late=%llu net_reordered=%llu cb_min_us=%.1f "
+		"cb_avg_us=%.1f cb_max_us=%.1f cb_jitter_us=%.1f user_ms=%.1f "
+		"sys_ms=%.1f\n",
+		(now.t - start->t) * 1e-9,
+		dt,
+		now.converted,
+		now.slots,
+		atomic_load_explicit(&s->gated, memory_order_relaxed),
+		atomic_load_explicit(&s->underruns, memory_order_relaxed),
+		dt > 0. ? (now.converted - snap->converted) / dt : 0.,
+		fill_min,
+		fills > 0. ? (now.fill_sum - snap->fill_sum) / fills : 0.,
+		fill_max,
+		atomic_load_explicit(&s->read_ns, memory_order_relaxed) * 1e-6,
+		atomic_load_explicit(&s->convert_ns, memory_order_relaxed) * 1e-6,
+		atomic_load_explicit(&s->full_waits, memory_order_relaxed),
+		atomic_load_explicit(&s->full_ns, memory_order_relaxed) * 1e-6,
+		atomic_load_explicit(&s->net_packets, memory_order_relaxed),
+		atomic_load_explicit(&s->net_lost, memory_order_relaxed),
+		atomic_load_explicit(&s->net_late, memory_order_relaxed),
+		atomic_load_explicit(&s->net_reordered, memory_order_relaxed),
+		cb_min * 1e-3,
+		cb_avg,
+		cb_max * 1e-3,
+		cb_jitter,
+		ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec * 1e-3,
+		ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec * 1e-3);
+
+	/* Only with tracing on, to the bin and since the start */
+	if(atomic_load_explicit(&s->handoff.count, memory_order_relaxed))
+		fprintf(f, "latency: handoff_p50_us=%.0f handoff_p99_us=%.0f "
+			"handoff_max_us=%.0f air_p50_us=%.0f air_p99_us=%.0f "
+			"air_max_us=%.0f\n",
+			hist_percentile(&s->handoff, .5),
+			hist_percentile(&s->handoff, .99),
+			atomic_load_explicit(&s->handoff.max_ns,
+				memory_order_relaxed) * 1e-3,
+			hist_percentile(&s->air, .5),
+			hist_percentile(&s->air, .99),
+			atomic_load_explicit(&s->air.max_ns, memory_order_relaxed) * 1e-3);
+
+	fflush(f);
+
+	*snap = now;
+}
+
+void stats_histogram(FILE *f, struct stats_s *s)
+{
+	unsigned long long a, b;
+	unsigned int n;
+
+	fprintf(f, "Slots by latency from their input to the handoff and to "
+		"the air:\n\t%12s%12s%12s\n", "up to us", "handoff", "air");
+
+	for(n = 0; n < STATS_HIST_BINS; n++)
+	{
+		a = atomic_load_explicit(&s->handoff.bins[n], memory_order_relaxed);
+		b = atomic_load_explicit(&s->air.bins[n], memory_order_relaxed);
+
+		if(!a && !b)
+			continue;
+
+		if(n < STATS_HIST_BINS - 1)
+			fprintf(f, "\t%12.0f%12llu%12llu\n", hist_bound(n), a, b);
+		else
+			fprintf(f, "\t%12s%12llu%12llu\n", "longer", a, b);
+	}
+
+	fflush(f);
+}
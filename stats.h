@@ -0,0 +1,197 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+
+/* Fields with different writers are kept this far apart, so the
+ * line doesn't bounce between their cores */
+#define CACHE_LINE			64
+
+/* Latency histograms have this many bins per octave of us, the two
+ * bits after the top one, the last bin takes whatever is longer
+ * (some 16s) */
+#define STATS_HIST_SUB		4
+#define STATS_HIST_OCTAVES	24
+#define STATS_HIST_BINS		(STATS_HIST_SUB * STATS_HIST_OCTAVES)
+
+/* Latency of ring slots, from its input being in to some point
+ * further down
+ */
+struct stats_hist_s
+{
+	atomic_ullong bins[STATS_HIST_BINS];
+	atomic_ullong count;
+	atomic_ullong max_ns;
+};
+
+/* Pipeline counters
+ * The reader's fields have exactly one writer, those are bumped with
+ * a plain relaxed load and store (stats_add) so the per block paths
+ * never pay for a locked instruction. The worker pool shares converted
+ * and convert_ns, every device's consumer shares the slot, gated,
+ * underrun, fill and callback fields, those are once per buffer
+ * anyway and start on a cache line after the reader's. The reporter
+ * just reads, except for the interval minimum and maximum it swaps
+ * back to their start values.
+ */
+struct stats_s
+{
+	atomic_ullong converted;		/* Samples converted (reader, workers) */
+	atomic_ullong convert_ns;		/* Time spent in conversion */
+	atomic_ullong read_ns;			/* Time spent in read() (reader) */
+	atomic_ullong full_waits;		/* Reader found the ring full */
+	atomic_ullong full_ns;			/* ...and waited this long for room */
+	atomic_ullong net_packets;		/* Datagrams received (reader) */
+	atomic_ullong net_lost;			/* ...never came, sent as silence */
+	atomic_ullong net_late;			/* ...came too late or twice */
+	atomic_ullong net_reordered;	/* ...came out of order, in time */
+	atomic_ullong slots				/* Buffers handed to libbladeRF */
+		__attribute__((aligned(CACHE_LINE)));
+	atomic_ullong gated;			/* Quiet slots not sent at all */
+	atomic_ullong underruns;		/* Callbacks that found the ring empty */
+	atomic_ullong fill_sum;			/* Ring fill level in slots, seen */
+	atomic_ullong fill_count;		/* ...by the callback */
+	atomic_ullong fill_min;
+	atomic_ullong fill_max;
+	atomic_ullong cb_sum_ns;		/* Time between two callbacks */
+	atomic_ullong cb_jitter_ns;		/* ...and |change| of that time */
+	atomic_ullong cb_count;
+	atomic_ullong cb_min_ns;
+	atomic_ullong cb_max_ns;
+	struct stats_hist_s handoff;	/* Slot handed to libbladeRF */
+	struct stats_hist_s air;		/* ...and on the air */
+};
+
+/* Callback timing of one consumer
+ */
+struct stats_clock_s
+{
+	unsigned long long last;		/* Last callback */
+	unsigned long long prev;		/* Time between the two before */
+};
+
+/* What the last report saw, for the per interval numbers
+ */
+struct stats_snap_s
+{
+	unsigned long long t;
+	unsigned long long converted;
+	unsigned long long slots;
+	unsigned long long fill_sum;
+	unsigned long long fill_count;
+	unsigned long long cb_sum_ns;
+	unsigned long long cb_jitter_ns;
+	unsigned long long cb_count;
+};
+
+static inline unsigned long long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Single writer increment */
+static inline void stats_add(atomic_ullong *c, unsigned long long v)
+{
+	atomic_store_explicit(c,
+		atomic_load_explicit(c, memory_order_relaxed) + v,
+		memory_order_relaxed);
+}
+
+/* Increment shared by several writers */
+static inline void stats_add_shared(atomic_ullong *c, unsigned long long v)
+{
+	atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+/* Shared minimum and maximum, also lowered/raised by the reporter */
+static inline void stats_min(atomic_ullong *c, unsigned long long v)
+{
+	unsigned long long old = atomic_load_explicit(c, memory_order_relaxed);
+
+	while(v < old && !atomic_compare_exchange_weak_explicit(c, &old, v,
+		memory_order_relaxed, memory_order_relaxed));
+}
+
+static inline void stats_max(atomic_ullong *c, unsigned long long v)
+{
+	unsigned long long old = atomic_load_explicit(c, memory_order_relaxed);
+
+	while(v > old && !atomic_compare_exchange_weak_explicit(c, &old, v,
+		memory_order_relaxed, memory_order_relaxed));
+}
+
+/* Ring fill level as a consumer sees it */
+static inline void stats_fill(struct stats_s *s, unsigned int fill)
+{
+	stats_add_shared(&s->fill_sum, fill);
+	stats_add_shared(&s->fill_count, 1);
+	stats_min(&s->fill_min, fill);
+	stats_max(&s->fill_max, fill);
+}
+
+/* Called at the top of every callback */
+static inline void stats_callback(struct stats_s *s, struct stats_clock_s *c)
+{
+	unsigned long long now = stats_now();
+	unsigned long long d = now - c->last;
+
+	if(c->last)
+	{
+		stats_add_shared(&s->cb_sum_ns, d);
+		if(c->prev)
+			stats_add_shared(&s->cb_jitter_ns,
+				d > c->prev ? d - c->prev : c->prev - d);
+		stats_add_shared(&s->cb_count, 1);
+		stats_min(&s->cb_min_ns, d);
+		stats_max(&s->cb_max_ns, d);
+
+		c->prev = d;
+	}
+
+	c->last = now;
+}
+
+/* Which bin ns goes into */
+static inline unsigned int stats_hist_bin(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	unsigned int o, sub, bin;
+
+	if(!us)
+		return 0;
+
+	o = 63 - __builtin_clzll(us);
+	sub = o >= 2 ? (us >> (o - 2)) & 3 : (us << (2 - o)) & 3;
+	bin = o * STATS_HIST_SUB + sub;
+
+	return bin < STATS_HIST_BINS ? bin : STATS_HIST_BINS - 1;
+}
+
+/* Any consumer */
+static inline void stats_latency(struct stats_hist_s *h,
+		unsigned long long ns)
+{
+	stats_add_shared(&h->bins[stats_hist_bin(ns)], 1);
+	stats_add_shared(&h->count, 1);
+	stats_max(&h->max_ns, ns);
+}
+
+void stats_init(struct stats_s *s, struct stats_snap_s *snap);
+
+/* Print one line of key=value pairs, totals since the start and
+ * fill level and callback timing since the last report */
+void stats_report(FILE *f, struct stats_s *s, struct stats_snap_s *snap,
+		const struct stats_snap_s *start);
+
+/* Both latency histograms side by side, since the start */
+void stats_histogram(FILE *f, struct stats_s *s);
+
+#endif
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+/* No liburing, the three system calls and the rings are simple
+ * enough by hand */
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
+
+/* Another descriptor for the same file, ours to set O_DIRECT on
+ * without the stdio side noticing */
+static int uring_reopen(int fd, bool direct)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%i", fd);
+
+	return open(path, O_RDONLY | O_CLOEXEC | (direct ? O_DIRECT : 0));
+}
+
+/* Read into the rest of a block */
+static void uring_queue(struct uring_s *u, unsigned int idx)
+{
+	struct uring_buf_s *b = &u->bufs[idx];
+	unsigned int tail = *u->sq_tail;
+	unsigned int slot = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[slot];
+
+	b->iov.iov_base = b->data + b->len;
+	b->iov.iov_len = u->block - b->len;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = u->file;
+	sqe->addr = (uint64_t)(uintptr_t)&b->iov;
+	sqe->len = 1;
+	sqe->off = b->offset + b->len;
+	sqe->user_data = idx;
+
+	u->sq_array[slot] = slot;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	u->inflight++;
+}
+
+/* The next block of the file goes into this one */
+static void uring_next(struct uring_s *u, unsigned int idx)
+{
+	struct uring_buf_s *b = &u->bufs[idx];
+
+	b->offset = u->offset;
+	b->len = 0;
+	b->done = false;
+	b->eof = false;
+	b->error = 0;
+	u->offset += u->block;
+
+	uring_queue(u, idx);
+}
+
+/* Sort in whatever completed */
+static void uring_reap(struct uring_s *u)
+{
+	unsigned int head = *u->cq_head;
+	struct io_uring_cqe *cqe;
+	struct uring_buf_s *b;
+
+	while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &u->cqes[head & *u->cq_mask];
+		b = &u->bufs[cqe->user_data];
+		u->inflight--;
+
+		if(cqe->res == -EINTR || cqe->res == -EAGAIN)
+			uring_queue(u, cqe->user_data);
+		else if(cqe->res < 0)
+		{
+			b->error = -cqe->res;
+			b->done = true;
+			b->eof = true;
+		}
+		else if(cqe->res == 0)
+		{
+			b->done = true;
+			b->eof = true;
+		}
+		else
+		{
+			b->len += cqe->res;
+
+			/* Short reads are the end of the file, except buffered
+			 * reads may also just stop early */
+			if(b->len == u->block)
+				b->done = true;
+			else if(u->direct && b->len % URING_ALIGN)
+			{
+				b->done = true;
+				b->eof = true;
+			}
+			else
+				uring_queue(u, cqe->user_data);
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Hand the kernel what is queued, and wait for a completion if asked
+ * to */
+static int uring_submit(struct uring_s *u, bool wait)
+{
+	unsigned int pending = *u->sq_tail
+		- __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if(!pending && !wait)
+		return 0;
+
+	if(uring_enter(u->fd, pending, wait ? 1 : 0,
+		wait ? IORING_ENTER_GETEVENTS : 0) < 0)
+		return -1;
+
+	uring_reap(u);
+
+	return 0;
+}
+
+int uring_open(struct uring_s *u, int fd, unsigned int depth, size_t block)
+{
+	struct io_uring_params p;
+	off_t start = lseek(fd, 0, SEEK_CUR);
+	unsigned int m;
+	int err;
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	u->depth = depth;
+	u->block = (block + URING_ALIGN - 1) / URING_ALIGN * URING_ALIGN;
+	u->offset = start < 0 ? 0 : start;
+
+	/* Whatever we are sitting on might not do O_DIRECT, tmpfs for
+	 * one, it's just slower through the page cache then */
+	u->direct = !(u->offset % URING_ALIGN);
+	u->file = uring_reopen(fd, u->direct);
+	if(u->file < 0 && u->direct)
+	{
+		u->direct = false;
+		u->file = uring_reopen(fd, false);
+	}
+	if(u->file < 0)
+		return -1;
+
+	if(!u->direct)
+		posix_fadvise(u->file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	memset(&p, 0, sizeof(p));
+	u->fd = uring_setup(depth, &p);
+	if(u->fd < 0)
+		goto error;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Newer kernels map both rings at once */
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = 0;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sq_ring == MAP_FAILED)
+	{
+		u->sq_ring = NULL;
+		goto error;
+	}
+
+	if(u->cq_ring_size)
+	{
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if(u->cq_ring == MAP_FAILED)
+		{
+			u->cq_ring = NULL;
+			goto error;
+		}
+	}
+	else
+		u->cq_ring = u->sq_ring;
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED)
+	{
+		u->sqes = NULL;
+		goto error;
+	}
+
+	u->sq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	u->bufs = calloc(depth, sizeof(*u->bufs));
+	if(!u->bufs || posix_memalign((void **)&u->data, URING_ALIGN,
+		(size_t)depth * u->block))
+	{
+		u->data = NULL;
+		errno = ENOMEM;
+		goto error;
+	}
+
+	/* Everything in flight from the start */
+	for(m = 0; m < depth; m++)
+	{
+		u->bufs[m].data = u->data + (size_t)m * u->block;
+		uring_next(u, m);
+	}
+
+	if(uring_submit(u, false))
+	{
+		u->inflight = 0;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	err = errno;
+	uring_close(u);
+	errno = err;
+
+	return -1;
+}
+
+ssize_t uring_read(struct uring_s *u, void *ptr, size_t len)
+{
+	struct uring_buf_s *b;
+	size_t have = 0, n;
+
+	while(have < len)
+	{
+		b = &u->bufs[u->head];
+
+		if(!b->done)
+		{
+			/* What we have now goes out rather than waiting */
+			if(have)
+				break;
+
+			if(uring_submit(u, true))
+				return -1;
+
+			continue;
+		}
+
+		if(u->pos < b->len)
+		{
+			n = b->len - u->pos;
+			if(n > len - have)
+				n = len - have;
+
+			memcpy((char *)ptr + have, b->data + u->pos, n);
+			u->pos += n;
+			have += n;
+			continue;
+		}
+
+		/* Stays the head, everything after it reads the same */
+		if(b->eof)
+		{
+			if(b->error && !have)
+			{
+				errno = b->error;
+				return -1;
+			}
+
+			break;
+		}
+
+		/* Used up, the page cache doesn't need it either */
+		if(!u->direct)
+			posix_fadvise(u->file, b->offset, b->len, POSIX_FADV_DONTNEED);
+
+		uring_next(u, u->head);
+		u->head = (u->head + 1) % u->depth;
+		u->pos = 0;
+	}
+
+	/* The reads just queued get going while this is converted */
+	if(uring_submit(u, false) && !have)
+		return -1;
+
+	return have;
+}
+
+void uring_close(struct uring_s *u)
+{
+	/* The kernel may still be writing into the blocks */
+	while(u->fd >= 0 && u->inflight && (!uring_submit(u, true)
+		|| errno == EINTR));
+
+	if(u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if(u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if(u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if(u->fd >= 0)
+		close(u->fd);
+	if(u->file >= 0)
+		close(u->file);
+
+	free(u->bufs);
+	free(u->data);
+
+	u->fd = -1;
+	u->file = -1;
+	u->sqes = NULL;
+	u->sq_ring = NULL;
+	u->cq_ring = NULL;
+	u->bufs = NULL;
+	u->data = NULL;
+	u->inflight = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/* Offsets, lengths and buffers of O_DIRECT reads are multiples of
+ * this, enough for any logical block size */
+#define URING_ALIGN			4096
+
+/* One block of the read ahead
+ */
+struct uring_buf_s
+{
+	char *data;
+	struct iovec iov;			/* What is being read into it */
+	uint64_t offset;			/* File offset of data[0] */
+	size_t len;					/* Bytes in data so far */
+	bool done;					/* len is final */
+	bool eof;					/* ...and the file ends after it */
+	int error;					/* errno of a failed read */
+};
+
+/* Reads a regular file front to back with depth reads of block bytes
+ * in flight, with O_DIRECT if the file system allows */
+struct uring_s
+{
+	int fd;						/* The io_uring */
+	int file;					/* Our own descriptor of the input */
+	bool direct;				/* ...opened with O_DIRECT */
+	unsigned int depth;
+	size_t block;
+
+	struct uring_buf_s *bufs;
+	char *data;					/* All blocks back to back, aligned */
+	uint64_t offset;			/* Where the next block to queue starts */
+	unsigned int head;			/* Block going out next */
+	size_t pos;					/* ...bytes of it handed out */
+	unsigned int inflight;
+
+	void *sq_ring;				/* Rings shared with the kernel */
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* Start reading fd from its current position, block is rounded up
+ * to URING_ALIGN. Returns -1 with errno if io_uring can't be used,
+ * fd is left alone then. */
+int uring_open(struct uring_s *u, int fd, unsigned int depth, size_t block);
+
+/* Like read(), blocks only if nothing is there yet */
+ssize_t uring_read(struct uring_s *u, void *ptr, size_t len);
+
+/* Waits for the reads still in flight */
+void uring_close(struct uring_s *u);
+
+#endif